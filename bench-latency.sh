@@ -0,0 +1,75 @@
+#!/bin/sh
+# bench-latency.sh: measures the latency of converting small zones one at
+# a time, which is dominated by fixed per-zone costs rather than
+# throughput.
+#
+#   ./bench-latency.sh [zones] [min records] [max records]
+#
+# <zones> zones of <min records> to <max records> records each are
+# generated and converted two ways:
+#
+#   batch    one process converting them in turn (-b), as a long-running
+#            caller would; per-zone wall time from -a
+#   process  a new bind-to-tinydns process per zone, timed from outside,
+#            which adds process startup and exit
+#
+# and the p50, p99 and p99.9 latencies and the maximum are printed in
+# microseconds.  The batch numbers include resetting and freeing the
+# per-zone state; process includes everything, plus a little of the
+# timing itself.  (A worker pool's handoff can't be seen from -a, which
+# is timed inside the worker; it shows up as overhead in
+# bench-scaling.sh instead.)
+
+BIN=${BIN:-./bind-to-tinydns}
+ZONES=${1:-10000}
+MIN=${2:-10}
+MAX=${3:-100}
+DIR=$(mktemp -d /tmp/bench-latency.XXXXXX) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+echo "generating $ZONES zones of $MIN-$MAX records under $DIR" >&2
+awk -v zones="$ZONES" -v min="$MIN" -v max="$MAX" -v dir="$DIR" 'BEGIN {
+    srand (1)
+    for (z = 0; z < zones; z++) {
+        f = dir "/z" z ".db"
+        printf "$TTL 3600\n@ SOA ns1 hostmaster 1 7200 3600 604800 300\n" > f
+        printf "@ NS ns1\nns1 A 192.0.2.1\n" > f
+        n = min + int (rand () * (max - min + 1)) - 3
+        for (i = 0; i < n; i++) {
+            if (i % 3 == 0)
+                printf "h%d A 10.0.%d.%d\n", i, int (i / 256), i % 256 > f
+            else if (i % 3 == 1)
+                printf "h%d MX 10 mail\n", i > f
+            else
+                printf "h%d TXT \"record %d\"\n", i, i > f
+        }
+        close (f)
+        print "z" z ".bench " f " " dir "/z" z ".data " dir "/z" z ".tmp" \
+            > (dir "/batch")
+    }
+}'
+
+# percentiles: prints the nearest-rank percentiles of the latencies (in
+# seconds, one per line) on stdin, in microseconds
+percentiles () {
+    sort -g | awk -v mode="$1" '{ v[NR] = $1 * 1e6 }
+    function rank (p) { r = int (p * NR + 0.999999); return r < 1 ? 1 : r }
+    END {
+        printf "%s\t%d\t%.0f\t%.0f\t%.0f\t%.0f\n", mode, NR,
+            v[rank(0.5)], v[rank(0.99)], v[rank(0.999)], v[NR]
+    }'
+}
+
+printf "mode\tzones\tp50_us\tp99_us\tp999_us\tmax_us\n"
+
+rm -f "$DIR"/*.data
+"$BIN" -a table -b "$DIR/batch" | awk '!/^#/ { print $4 }' |
+    percentiles batch
+
+rm -f "$DIR"/*.data
+while read origin input output temp; do
+    start=$(date +%s.%N)
+    "$BIN" "$origin" "$output" "$temp" < "$input" || exit 1
+    end=$(date +%s.%N)
+    echo "$start $end"
+done < "$DIR/batch" | awk '{ print $2 - $1 }' | percentiles process
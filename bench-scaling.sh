@@ -0,0 +1,95 @@
+#!/bin/sh
+# bench-scaling.sh: measures how bind-to-tinydns scales with the number of
+# worker processes (-j) and verify threads (-t).
+#
+#   ./bench-scaling.sh [max workers] [records] [zones] [escaped]
+#
+# A zone of <records> A, MX and TXT records is generated and split into
+# <zones> zones, which are converted as a batch with 1 to <max workers>
+# workers.  If "escaped" is given, the records are all TXT records of mostly
+# UTF-8 text, much of which has to be written as octal escapes.  For each
+# count, the wall time, speedup, efficiency and the Karp-Flatt estimate of
+# the serial fraction are printed, followed by the per-stage times summed
+# over all zones (from -a table), and the parent's overhead: wall time not
+# covered by the zones' own wall time.  The generated tinydns-data is then
+# checked with verify at each thread count.
+
+BIN=${BIN:-./bind-to-tinydns}
+MAX=${1:-$(getconf _NPROCESSORS_ONLN)}
+RECORDS=${2:-1000000}
+ZONES=${3:-64}
+TXT=${4:-plain}
+DIR=$(mktemp -d /tmp/bench-scaling.XXXXXX) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+now () { date +%s.%N; }
+
+echo "generating $RECORDS records ($TXT TXT) in $ZONES zones under $DIR" >&2
+awk -v records="$RECORDS" -v zones="$ZONES" -v dir="$DIR" \
+    -v txt="$TXT" 'BEGIN {
+    for (z = 0; z < zones; z++) {
+        f = dir "/z" z ".db"
+        printf "$TTL 3600\n@ SOA ns1 hostmaster 1 7200 3600 604800 300\n" > f
+        printf "@ NS ns1\nns1 A 192.0.2.1\n" > f
+        print "z" z ".bench " f " " dir "/z" z ".data " dir "/z" z ".tmp" \
+            > (dir "/batch")
+    }
+    for (i = 0; i < records; i++) {
+        f = dir "/z" (i % zones) ".db"
+        if (txt == "escaped")
+            printf "h%d TXT \"café naïve résumé über ça %d\"\n", i, i > f
+        else if (i % 3 == 0)
+            printf "h%d A 10.%d.%d.%d\n", i, int (i / 65536) % 256,
+                int (i / 256) % 256, i % 256 > f
+        else if (i % 3 == 1)
+            printf "h%d MX 10 mail%d\n", i, i % 97 > f
+        else
+            printf "h%d TXT \"v=spf1 ip4:10.0.%d.0/24 -all\"\n", i,
+                i % 256 > f
+    }
+}'
+
+echo "# conversion: -j workers over $ZONES zones"
+printf "%s\t%s\t%s\t%s\t%s" workers wall_s speedup efficiency serial
+printf "\t%s\t%s\t%s\t%s\t%s\n" setup_s read_s convert_s finish_s overhead_s
+j=1
+while [ "$j" -le "$MAX" ]; do
+    rm -f "$DIR"/*.data
+    start=$(now)
+    "$BIN" -j "$j" -a table -b "$DIR/batch" > "$DIR/acct" || exit 1
+    end=$(now)
+    awk -v j="$j" -v wall="$(echo "$start $end" | awk '{print $2 - $1}')" \
+        -v base_file="$DIR/base" '
+    !/^#/ { zwall += $4; for (s = 0; s < 4; s++) stage[s] += $(9 + s) }
+    END {
+        if (j == 1) { base = wall; print wall > base_file }
+        else { getline base < base_file }
+        speedup = base / wall
+        serial = j > 1 ? (1 / speedup - 1 / j) / (1 - 1 / j) : 0
+        printf "%d\t%.3f\t%.2f\t%.2f\t%.3f", j, wall, speedup,
+            speedup / j, serial
+        printf "\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\n", stage[0], stage[1],
+            stage[2], stage[3], wall - zwall / j
+    }' "$DIR/acct"
+    j=$((j + 1))
+done
+
+cat "$DIR"/*.data > "$DIR/all.data"
+echo "# verify: -t threads over $(wc -c < "$DIR/all.data") bytes"
+printf "%s\t%s\t%s\t%s\t%s\n" threads wall_s speedup efficiency serial
+j=1
+while [ "$j" -le "$MAX" ]; do
+    start=$(now)
+    "$BIN" verify -t "$j" "$DIR/all.data" || exit 1
+    end=$(now)
+    echo "$start $end" | awk -v j="$j" -v base_file="$DIR/vbase" '{
+        wall = $2 - $1
+        if (j == 1) { base = wall; print wall > base_file }
+        else { getline base < base_file }
+        speedup = base / wall
+        serial = j > 1 ? (1 / speedup - 1 / j) / (1 - 1 / j) : 0
+        printf "%d\t%.3f\t%.2f\t%.2f\t%.3f\n", j, wall, speedup,
+            speedup / j, serial
+    }'
+    j=$((j + 1))
+done
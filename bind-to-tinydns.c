@@ -1,50 +1,315 @@
 /* bind-to-tinydns.c, version 0.4.2, 20040326
  * written by Daniel Erat <dan-tinydns@erat.org> -- http://erat.org/ */
 
+#define _GNU_SOURCE             /* for CPU sets */
+
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #define LINE_LEN 8192
+#define IO_BUF_LEN 65536
 #define DOMAIN_LEN 255
 #define MAX_TOKENS 32
 #define MAX_PAREN 3
 #define MAX_GEN_PARTS 10
 #define DEFAULT_TTL 86400
+#define MAX_WORKERS 256
+#define MAX_NODES 64
+#define ROARING_COOKIE 12346    /* portable format without run containers */
+#define ROARING_MAX_ARRAY 4096  /* larger containers are stored as bitmaps */
+#define BLOOM_MAGIC "B2TBLOOM"
+#define BLOOM_BLOCK_BITS 512    /* one cache line */
+#define BLOOM_HEADER_LEN 64
+#define CHECKPOINT_MAGIC "bind-to-tinydns checkpoint 2"
+#define INDEX_MAGIC "bind-to-tinydns index 1"
+#define PUNY_BASE 36             /* punycode parameters from RFC 3492 */
+#define PUNY_TMIN 1
+#define PUNY_TMAX 26
+#define PUNY_SKEW 38
+#define PUNY_DAMP 700
+#define VERIFY_MAX_THREADS 64
+#define VERIFY_MAX_ERRORS 10    /* reported per thread */
+#define VERIFY_MAX_FIELDS 16
+#define MAX_LOCATIONS 1024
+#define GZ_BLOCK_LEN 65536      /* largest BGZF block, either way */
+#define GZ_HEAD_LEN 12          /* gzip header up to the extra field */
+#define GZ_MAX_THREADS 64
+#define LOC_UNSET -1            /* no location (from this node) */
+#define LOC_MIXED -2            /* subtree maps to several locations */
 
 #define DOMAIN_STR_LEN (DOMAIN_LEN * 4 + 1)
+#define DB_NAME_LEN (DOMAIN_STR_LEN * 2)
 
 typedef struct string {
     char text[DOMAIN_STR_LEN];
     int len, real_len;
 } string;
 
+/* token bucket used to limit input and output bandwidth.  a rate of 0
+ * means unlimited. */
+typedef struct bucket {
+    double rate;            /* bytes per second */
+    double tokens;          /* bytes we may transfer without sleeping */
+    struct timeval last;    /* when tokens was last refilled */
+} bucket;
+
+/* stages of a conversion that are timed separately for accounting */
+enum { STAGE_SETUP, STAGE_READ, STAGE_CONVERT, STAGE_FINISH, NUM_STAGES };
+
+/* things that hold memory, for the memory counters */
+enum { MEM_INPUT, MEM_ENTRY, MEM_OUTPUT, MEM_LISTINGS, MEM_BLOOM, MEM_LINT,
+       NUM_MEM };
+
+/* record types that we emit, used to index the per-type counters */
+enum { RR_SOA, RR_NS, RR_MX, RR_A, RR_AAAA, RR_CNAME, RR_PTR, RR_TXT,
+       RR_SRV, RR_OTHER, NUM_RR_TYPES };
+
+/* resources consumed while converting a zone */
+typedef struct zone_acct {
+    double cpu_secs, wall_secs;
+    double stage_secs[NUM_STAGES];  /* wall time, if timing stages */
+    unsigned long long bytes_in, bytes_out;
+    unsigned long records;
+    long max_rss_kb;        /* process-wide high-water mark */
+    unsigned long mem_peak_kb[NUM_MEM];
+    int failed;
+} zone_acct;
+
+/* a zone to convert, from the command line or a batch file */
+typedef struct job {
+    char *origin;
+    char *input;            /* NULL for stdin */
+    char *output, *temp;
+    off_t ahead_len;        /* bytes of input prefetched by read_ahead */
+    int temp_existed;       /* temp was there before a worker got the job */
+    zone_acct acct;
+} job;
+
+/* IPv4 addresses listed in a reversed-IP DNSBL zone that share the same
+ * return code (the address in their A records) */
+typedef struct listing {
+    unsigned int code;          /* host byte order, as are addrs */
+    unsigned int *addrs;
+    size_t num_addrs, size;
+} listing;
+
+/* how far a conversion had got, saved periodically so that an interrupted
+ * conversion can carry on from there instead of starting over */
+typedef struct checkpoint {
+    long long in_offset;    /* input consumed, at an entry boundary */
+    long long out_len;      /* temp file bytes known to be on disk */
+    int line_num;
+    unsigned int ttl;
+    int prev_owner;
+    string origin, owner;
+    unsigned long rr_count[NUM_RR_TYPES];   /* only kept in checkpoints */
+} checkpoint;
+
+/* the part of a tinydns-data file checked by one verify thread */
+typedef struct verify_chunk {
+    const char *start, *end;
+    unsigned long num_lines;            /* lines in this chunk */
+    unsigned long num_errors;
+    unsigned long error_line[VERIFY_MAX_ERRORS];  /* within the chunk */
+    const char *error_msg[VERIFY_MAX_ERRORS];
+    int node;                           /* NUMA node to run on */
+} verify_chunk;
+
+/* a node of the binary trie that locations compiles prefixes into.  loc
+ * is the index of the location given for exactly this prefix, or
+ * LOC_UNSET. */
+typedef struct loc_node {
+    struct loc_node *child[2];
+    int loc;
+} loc_node;
+
+/* an (owner, type) pair seen by the lint pass.  the key is the hash of
+ * the owner with its low four bits replaced by the RR_* type, or 0 for an
+ * empty slot. */
+typedef struct rrset_entry {
+    unsigned long long key;
+    unsigned int ttl, count;
+} rrset_entry;
+
+/* an in-zone name that an NS record points at, which needs addresses */
+typedef struct ns_target {
+    unsigned long long hash;
+    int line_number;
+    char *name;
+} ns_target;
+
+/* a pre-forked process that converts batch jobs handed to it by the
+ * parent.  job indexes go down job_fd and job_results come back up
+ * result_fd. */
+typedef struct worker {
+    pid_t pid;
+    int job_fd, result_fd;
+    int cur_job;            /* index of job being converted, or -1 */
+} worker;
+
+/* a job's input size, for ordering the pool's jobs */
+typedef struct job_size {
+    off_t len;
+    int index;
+} job_size;
+
+/* a directory that publish_jobs has renamed files into or out of */
+typedef struct publish_dir {
+    dev_t dev;
+    ino_t ino;
+    int fd;
+} publish_dir;
+
+/* what a worker reports back after converting a job */
+typedef struct job_result {
+    int index;
+    zone_acct acct;
+} job_result;
+
+const char *rr_type_names[NUM_RR_TYPES] = {
+    "SOA", "NS", "MX", "A", "AAAA", "CNAME", "PTR", "TXT", "SRV", "other"
+};
+const char *stage_names[NUM_STAGES] = {
+    "setup", "read", "convert", "finish"
+};
+const char *mem_names[NUM_MEM] = {
+    "input", "entry", "output", "listings", "bloom", "lint"
+};
+
+FILE *input = NULL;      /* file pointer for BIND zone */
 FILE *file = NULL;       /* file pointer for temp file */
 char *filename = NULL;   /* filename of temp file */
 int line_num = 1;        /* actual line num */
 int start_line_num = 1;  /* line on which current entry started */
+int prev_owner = 0;      /* set once an RR has supplied an owner */
+string owner;            /* owner of the last RR, inherited by blank ones */
+
+const char *zone_name = NULL;   /* prefixed to messages in batch mode */
+jmp_buf *fatal_env = NULL;      /* where fatal() returns to, if set */
+
+/* progress counters, dumped to stderr when we get SIGUSR1 */
+unsigned long long bytes_in = 0;         /* bytes read from input */
+unsigned long long bytes_out = 0;        /* bytes written to temp file */
+unsigned long rr_count[NUM_RR_TYPES];    /* records emitted, by type */
+const char *phase = "starting";          /* what we're doing right now */
+struct timeval start_time;               /* when the conversion started */
+struct timeval last_stats_time;          /* when counters were last dumped */
+unsigned long long last_stats_bytes = 0; /* bytes_in at that point */
+volatile sig_atomic_t stats_requested = 0;
+int time_stages = 0;                     /* time stages for accounting */
+double stage_secs[NUM_STAGES];           /* wall time spent in each */
+size_t mem_reserved[NUM_MEM];            /* bytes allocated, by owner */
+size_t mem_peak[NUM_MEM];                /* high-water marks this zone */
+char input_buf[IO_BUF_LEN];              /* stdio buffers for the zone */
+char output_buf[IO_BUF_LEN];
+
+bucket in_bucket, out_bucket;            /* bandwidth limits */
+int idn = 0;                             /* punycode UTF-8 labels (-u) */
+int fold_names = 0;                      /* lowercase names (-c) */
+int check_hostnames = 0;                 /* require LDH host names (-H) */
+int load_db = 0;                         /* load records into SQLite (-S) */
+char *db_content = NULL;                 /* TXT record content for -S */
+size_t db_content_size = 0;
+
+int export_listings = 0;                 /* write roaring bitmaps (-I) */
+listing *listings = NULL;                /* one per return code */
+int num_listings = 0;
+
+unsigned int checkpoint_interval = 0;    /* entries between checkpoints */
+int resume = 0;                          /* resume from checkpoints (-r) */
+char checkpoint_name[PATH_MAX];          /* "" if not checkpointing */
+
+unsigned int index_interval = 0;         /* entries between index records */
+FILE *index_file = NULL;                 /* entry index being written */
+char index_name[PATH_MAX];               /* its temp file */
+
+int lint = 0;                            /* check zone semantics (-l) */
+rrset_entry *rrsets = NULL;              /* open-addressed hash table */
+size_t num_rrsets = 0, rrsets_size = 0;
+ns_target *ns_targets = NULL;
+size_t num_ns_targets = 0, ns_targets_size = 0;
+unsigned long lint_problems = 0;
+
+cpu_set_t node_cpus[MAX_NODES];          /* CPUs of each NUMA node */
+int num_nodes = 0;                       /* nodes with CPUs */
+int cpu_sharers = 1;                     /* workers sharing our CPUs */
+unsigned int max_gz_threads = 0;         /* inflate threads per zone (-T) */
+
+int *job_order = NULL;                   /* order the pool hands out jobs */
+int durable = 0;                         /* publish outputs durably (-d) */
+
+double readahead_budget = 32 << 20;     /* batch input to prefetch (-R) */
+int readahead_next = 0;                  /* first job not yet prefetched */
+int readahead_started = 0;               /* jobs started so far */
+off_t readahead_pending = 0;             /* prefetched, not yet started */
+
+double bloom_fp_rate = 0;                /* write a bloom filter (-F) */
+unsigned long long *owner_hashes = NULL; /* hashes of owners seen */
+size_t num_owner_hashes = 0, owner_hashes_size = 0;
 
 /* warning: prints a warning message to stderr */
 void warning (const char *message, int line_number)
 {
+    if (zone_name) fprintf (stderr, "%s: ", zone_name);
     if (line_number > 0)
         fprintf (stderr, "warning: line %d: %s\n",
              line_number, message);
     else fprintf (stderr, "warning: %s\n", message);
 }
 
+/* fatal_errno: prints an error message naming the zone, followed by the
+ * description of errno.  unlike fatal(), nothing is cleaned up, and the
+ * caller carries on (usually by returning failure). */
+void fatal_errno (const char *message)
+{
+    int err = errno;
+
+    if (zone_name) fprintf (stderr, "%s: ", zone_name);
+    fprintf (stderr, "fatal: %s: %s\n", message, strerror (err));
+}
+
 /* fatal: prints an error message with line number, closes and unlinks temp
- * file if necessary, and exits */
+ * file if necessary, and exits.  if fatal_env is set, we jump back there
+ * instead of exiting, so that a batch can continue with the next zone. */
 void fatal (const char *message, int line_number)
 {
+    if (zone_name) fprintf (stderr, "%s: ", zone_name);
     if (line_number > 0)
         fprintf (stderr, "fatal: line %d: %s\n",
              line_number, message);
@@ -58,10 +323,299 @@ void fatal (const char *message, int line_number)
             fprintf (stderr, "unable to unlink temp file: %s\n",
                  strerror (errno));
         }
+        if (checkpoint_name[0]) unlink (checkpoint_name);
+        file = NULL;
+    }
+    if (index_file) {
+        fclose (index_file);
+        unlink (index_name);
+        index_file = NULL;
     }
+    if (fatal_env) longjmp (*fatal_env, 1);
     exit (1);
 }
 
+/* handle_sigusr1: asks the main loop to dump the progress counters.  the
+ * dump itself isn't async-signal-safe, so it happens between entries. */
+void handle_sigusr1 (int sig)
+{
+    stats_requested = 1;
+}
+
+/* mem_resize: notes that an allocation belonging to subsystem sys has
+ * changed size from old_len to new_len bytes */
+void mem_resize (int sys, size_t old_len, size_t new_len)
+{
+    mem_reserved[sys] += new_len - old_len;
+    if (mem_reserved[sys] > mem_peak[sys])
+        mem_peak[sys] = mem_reserved[sys];
+}
+
+/* mem_used: returns how many of the bytes reserved by subsystem sys are
+ * holding data.  the stdio and entry buffers count as used once data has
+ * passed through them. */
+size_t mem_used (int sys)
+{
+    size_t used = 0;
+    int i;
+
+    switch (sys) {
+    case MEM_INPUT:
+    case MEM_ENTRY:
+        return bytes_in ? mem_reserved[sys] : 0;
+    case MEM_OUTPUT:
+        return bytes_out ? mem_reserved[sys] : 0;
+    case MEM_LISTINGS:
+        used = num_listings * sizeof (listing);
+        for (i = 0; i < num_listings; i++)
+            used += listings[i].num_addrs * sizeof (unsigned int);
+        return used;
+    case MEM_BLOOM:
+        return num_owner_hashes * sizeof (unsigned long long);
+    case MEM_LINT:
+        /* the strdup'd NS target names are always in use */
+        return mem_reserved[sys] - (rrsets_size - num_rrsets) *
+               sizeof (rrset_entry) - (ns_targets_size - num_ns_targets) *
+               sizeof (ns_target);
+    }
+    return 0;
+}
+
+/* stage_time: if stages are being timed, charges the time since *mark to
+ * stage and moves *mark up to now */
+void stage_time (int stage, double *mark)
+{
+    struct timespec ts;
+    double now;
+
+    if (!time_stages) return;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec + ts.tv_nsec / 1e9;
+    if (*mark) stage_secs[stage] += now - *mark;
+    *mark = now;
+}
+
+/* dump_stats: prints the progress counters to stderr.  throughput is
+ * measured over the interval since the previous dump (or since the start
+ * of the conversion, for the first one). */
+void dump_stats (const string *cur_origin)
+{
+    struct rusage ru;
+    struct timeval now;
+    double secs;
+    int i;
+
+    stats_requested = 0;
+    gettimeofday (&now, NULL);
+    secs = (now.tv_sec - last_stats_time.tv_sec) +
+           (now.tv_usec - last_stats_time.tv_usec) / 1000000.0;
+
+    fprintf (stderr, "stats: phase %s, line %d, %llu bytes read, "
+         "%llu bytes written, %.1f KB/s over last %.1f s, origin %s\n",
+         phase, line_num, bytes_in, bytes_out,
+         secs > 0 ? (bytes_in - last_stats_bytes) / secs / 1024 : 0,
+         secs, cur_origin ? cur_origin->text : "(none)");
+    fprintf (stderr, "stats: records:");
+    for (i = 0; i < NUM_RR_TYPES; i++)
+        fprintf (stderr, " %s %lu", rr_type_names[i], rr_count[i]);
+    fprintf (stderr, "\n");
+    fprintf (stderr, "stats: memory used/reserved/peak KB:");
+    for (i = 0; i < NUM_MEM; i++)
+        fprintf (stderr, " %s %zu/%zu/%zu", mem_names[i],
+             (mem_used (i) + 1023) / 1024,
+             (mem_reserved[i] + 1023) / 1024,
+             (mem_peak[i] + 1023) / 1024);
+    if (!getrusage (RUSAGE_SELF, &ru))
+        fprintf (stderr, ", max RSS %ld KB", ru.ru_maxrss);
+    fprintf (stderr, "\n");
+
+    last_stats_time = now;
+    last_stats_bytes = bytes_in;
+}
+
+/* throttle: takes len bytes worth of tokens from bucket b, sleeping until
+ * they are available if the bucket has run dry.  at most one second's
+ * worth of tokens is saved up, so bursts stay short. */
+void throttle (bucket *b, size_t len)
+{
+    struct timeval now;
+    double elapsed;
+
+    if (b->rate <= 0) return;
+
+    gettimeofday (&now, NULL);
+    if (!b->last.tv_sec) b->tokens = b->rate;
+    else {
+        elapsed = (now.tv_sec - b->last.tv_sec) +
+                  (now.tv_usec - b->last.tv_usec) / 1000000.0;
+        b->tokens += elapsed * b->rate;
+        if (b->tokens > b->rate) b->tokens = b->rate;
+    }
+    b->last = now;
+
+    b->tokens -= len;
+    if (b->tokens < 0) {
+        usleep ((useconds_t) (-b->tokens / b->rate * 1000000));
+        /* the sleep paid for the deficit */
+        gettimeofday (&b->last, NULL);
+        b->tokens = 0;
+    }
+}
+
+/* emit: writes formatted output to the temp file, counting and throttling
+ * it.  write errors are fatal. */
+void emit (const char *format, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start (ap, format);
+    ret = vfprintf (file, format, ap);
+    va_end (ap);
+    if (ret < 0) fatal ("unable to write to temp file", start_line_num);
+
+    bytes_out += ret;
+    throttle (&out_bucket, ret);
+}
+
+/* parse_rate: parses a bandwidth limit in bytes per second, optionally
+ * followed by k, m or g (powers of 1024).  returns 0 on success and 1
+ * otherwise. */
+int parse_rate (double *dest, const char *src)
+{
+    char *end;
+    double rate;
+
+    errno = 0;
+    rate = strtod (src, &end);
+    if (errno || end == src || rate < 0) return 1;
+    if (*end == 'k' || *end == 'K') rate *= 1024, end++;
+    else if (*end == 'm' || *end == 'M') rate *= 1024 * 1024, end++;
+    else if (*end == 'g' || *end == 'G') rate *= 1024 * 1024 * 1024, end++;
+    if (*end != '\0') return 1;
+
+    *dest = rate;
+    return 0;
+}
+
+/* put_octal: writes c to dest as a four-character "\ooo" escape */
+void put_octal (char *dest, unsigned char c)
+{
+    dest[0] = '\\';
+    dest[1] = '0' + (c >> 6);
+    dest[2] = '0' + ((c >> 3) & 7);
+    dest[3] = '0' + (c & 7);
+}
+
+#ifdef __SSE2__
+#ifdef __SSSE3__
+/* pshufb masks that pack four bytes expanded by sanitize_block, indexed by
+ * which of them are plain (bit i for byte i): a plain byte keeps only the
+ * first of its four */
+static const unsigned char pack[16][16] __attribute__ ((aligned (16))) = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 0, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 0, 1, 2, 3, 4, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 0, 4, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 13, 14, 15 },
+    { 0, 4, 5, 6, 7, 8, 12, 13, 14, 15 },
+    { 0, 1, 2, 3, 4, 8, 12, 13, 14, 15 },
+    { 0, 4, 8, 12, 13, 14, 15 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 },
+    { 0, 4, 5, 6, 7, 8, 9, 10, 11, 12 },
+    { 0, 1, 2, 3, 4, 8, 9, 10, 11, 12 },
+    { 0, 4, 8, 9, 10, 11, 12 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12 },
+    { 0, 4, 5, 6, 7, 8, 12 },
+    { 0, 1, 2, 3, 4, 8, 12 },
+    { 0, 4, 8, 12 }
+};
+/* the number of bytes each of those leaves */
+static const int pack_len[16] = {
+    16, 13, 13, 10, 13, 10, 10, 7, 13, 10, 10, 7, 10, 7, 7, 4
+};
+#endif
+
+/* sanitize_block: classifies the 16 bytes at src (which must not cross a
+ * page boundary) and copies them to dest up to the first backslash or NUL,
+ * writing printable characters other than ':' as-is and escaping the rest
+ * as "\ooo".  runs of plain characters are copied in one go; otherwise
+ * every byte is expanded to four in registers (itself, or the backslash and
+ * its three octal digits) and the results are packed together, four bytes
+ * per pshufb with SSSE3 and one at a time after that.  the stores can run
+ * up to 12 bytes past what is written, which is within the room dest has
+ * for the rest of the string at four bytes per character.  returns the
+ * number of bytes of src consumed and adds the number written to
+ * *dest_len. */
+int sanitize_block (char *dest, int *dest_len, const char *src)
+{
+    __m128i v, plain, special, seven, zero, lead, d0, d1, d2, lo, hi;
+    __m128i quads[4];
+    unsigned int plain_mask, n, i;
+    char *out = dest + *dest_len;
+
+    v = _mm_loadu_si128 ((const __m128i *) src);
+    /* printable is 0x20-0x7e; bytes above 0x7f are negative here */
+    plain = _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 (0x1f)),
+                           _mm_cmplt_epi8 (v, _mm_set1_epi8 (0x7f)));
+    plain = _mm_andnot_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (':')),
+                              plain);
+    special = _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\\')),
+                            _mm_cmpeq_epi8 (v, _mm_setzero_si128 ()));
+
+    n = _mm_movemask_epi8 (special);
+    n = n ? __builtin_ctz (n) : 16;
+    plain_mask = _mm_movemask_epi8 (plain);
+
+    if ((plain_mask & ((1U << n) - 1)) == (1U << n) - 1) {
+        memcpy (out, src, n);
+        *dest_len += n;
+        return n;
+    }
+
+    /* the octal digits of every byte.  the shifts are done on 16-bit
+     * lanes, so the masks also drop the bits of the neighbouring byte. */
+    seven = _mm_set1_epi8 (7);
+    zero = _mm_set1_epi8 ('0');
+    d0 = _mm_add_epi8 (_mm_and_si128 (_mm_srli_epi16 (v, 6),
+                                      _mm_set1_epi8 (3)), zero);
+    d1 = _mm_add_epi8 (_mm_and_si128 (_mm_srli_epi16 (v, 3), seven), zero);
+    d2 = _mm_add_epi8 (_mm_and_si128 (v, seven), zero);
+    lead = _mm_or_si128 (_mm_and_si128 (plain, v),
+                         _mm_andnot_si128 (plain, _mm_set1_epi8 ('\\')));
+
+    /* interleave them into lead, d0, d1, d2 for each of the 16 bytes */
+    lo = _mm_unpacklo_epi8 (lead, d0);
+    hi = _mm_unpacklo_epi8 (d1, d2);
+    quads[0] = _mm_unpacklo_epi16 (lo, hi);
+    quads[1] = _mm_unpackhi_epi16 (lo, hi);
+    lo = _mm_unpackhi_epi8 (lead, d0);
+    hi = _mm_unpackhi_epi8 (d1, d2);
+    quads[2] = _mm_unpacklo_epi16 (lo, hi);
+    quads[3] = _mm_unpackhi_epi16 (lo, hi);
+
+#ifdef __SSSE3__
+    /* pack four bytes' worth at a time */
+    for (i = 0; i + 4 <= n; i += 4) {
+        unsigned int m = plain_mask >> i & 15;
+        _mm_storeu_si128 ((__m128i *) out,
+                          _mm_shuffle_epi8 (quads[i / 4],
+                              _mm_load_si128 ((const __m128i *) pack[m])));
+        out += pack_len[m];
+    }
+#else
+    i = 0;
+#endif
+    for (; i < n; i++) {
+        memcpy (out, (char *) quads + i * 4, 4);
+        out += 4 - 3 * (plain_mask >> i & 1);
+    }
+
+    *dest_len = out - dest;
+    return n;
+}
+#endif
+
 /* sanitize_string: sanitizes the BIND-escaped string src and copies it to
  * the memory pointed to by dest.  a temporary string is used, so dest and
  * src can point to the same memory.  returns 0 on success and 1 otherwise.
@@ -78,6 +632,21 @@ int sanitize_string (string *dest, const char *src)
     for (temp.text[0] = '\0', temp.len = 0, temp.real_len = 0;
          *src != '\0'; src++) {
 
+#ifdef __SSE2__
+        /* handle everything up to the next backslash a block at a time,
+         * as long as the block fits and the load can't fault */
+        if (temp.len + 16 <= DOMAIN_LEN &&
+            ((uintptr_t) src & 4095) <= 4096 - 16) {
+            int n = sanitize_block (temp.text, &temp.real_len, src);
+            if (n) {
+                temp.len += n;
+                temp.text[temp.real_len] = '\0';
+                src += n - 1;
+                continue;
+            }
+        }
+#endif
+
         /* make sure temp isn't full */
         if (temp.len == DOMAIN_LEN) {
             warning ("sanitize_string: src string too long", -1);
@@ -103,8 +672,8 @@ int sanitize_string (string *dest, const char *src)
                  * handled specially */
                 if (*(src+1) == ':' || *(src+1) == '\\' ||
                     *(src+1) == '.' || !isprint (*(src+1))) {
-                    sprintf (temp.text + temp.real_len,
-                         "\\%03o", *(src+1));
+                    put_octal (temp.text + temp.real_len,
+                           *(src+1));
                     temp.len++;
                     temp.real_len += 4;
                 /* otherwise, just print it */
@@ -139,9 +708,8 @@ int sanitize_string (string *dest, const char *src)
                     /* otherwise, print it as an
                      * escaped octal sequence */
                     } else {
-                        sprintf (temp.text +
-                             temp.real_len,
-                             "\\%03o", num);
+                        put_octal (temp.text +
+                               temp.real_len, num);
                         temp.real_len += 4;
                         temp.len++;
                     }
@@ -155,7 +723,7 @@ int sanitize_string (string *dest, const char *src)
             }
         /* non-escaped sequence, but we need to escape it */
         } else {
-            sprintf (temp.text + temp.real_len, "\\%03o", *src);
+            put_octal (temp.text + temp.real_len, *src);
             temp.real_len += 4;
             temp.len++;
         }
@@ -166,6 +734,241 @@ int sanitize_string (string *dest, const char *src)
     return 0;
 }
 
+/* puny_adapt: the punycode bias adaptation function from RFC 3492 */
+unsigned long puny_adapt (unsigned long delta, unsigned long num_points,
+                          int first)
+{
+    unsigned long k = 0;
+
+    delta = first ? delta / PUNY_DAMP : delta / 2;
+    delta += delta / num_points;
+    for (; delta > ((PUNY_BASE - PUNY_TMIN) * PUNY_TMAX) / 2;
+         k += PUNY_BASE)
+        delta /= PUNY_BASE - PUNY_TMIN;
+    return k + (PUNY_BASE - PUNY_TMIN + 1) * delta / (delta + PUNY_SKEW);
+}
+
+/* punycode_label: converts the UTF-8 label of len bytes at src to an
+ * A-label ("xn--" followed by its punycode encoding) in dest, which holds
+ * size bytes.  ASCII letters are lowercased, but no other normalization is
+ * done.  returns the length of the A-label, or -1 if the label isn't
+ * valid UTF-8, the A-label is longer than 63 bytes or it doesn't fit. */
+int punycode_label (char *dest, int size, const char *src, int len)
+{
+    static const unsigned long min_cp[3] = { 0x80, 0x800, 0x10000 };
+    unsigned long cp[DOMAIN_LEN], n = 0x80, delta = 0, bias = 72, m, q, t;
+    unsigned long k, min;
+    int num_cp = 0, h, b, i, out = 4, extra;
+    const unsigned char *p = (const unsigned char *) src;
+
+    /* decode UTF-8, rejecting overlong and truncated sequences */
+    for (i = 0; i < len; num_cp++) {
+        if (num_cp == DOMAIN_LEN) return -1;
+        if (p[i] < 0x80) {
+            cp[num_cp] = tolower (p[i++]);
+            continue;
+        }
+        if ((p[i] & 0xe0) == 0xc0) extra = 1, m = p[i] & 0x1f;
+        else if ((p[i] & 0xf0) == 0xe0) extra = 2, m = p[i] & 0x0f;
+        else if ((p[i] & 0xf8) == 0xf0) extra = 3, m = p[i] & 0x07;
+        else return -1;
+        if (i + extra >= len) return -1;
+        min = min_cp[extra - 1];
+        for (i++; extra > 0; extra--, i++) {
+            if ((p[i] & 0xc0) != 0x80) return -1;
+            m = (m << 6) | (p[i] & 0x3f);
+        }
+        /* an overlong sequence encodes what a shorter one could have */
+        if (m < min || m > 0x10ffff || (m >= 0xd800 && m <= 0xdfff))
+            return -1;
+        cp[num_cp] = m;
+    }
+
+    if (size < 5) return -1;
+    memcpy (dest, "xn--", 4);
+
+    /* basic code points go first, followed by a delimiter */
+    for (i = 0, b = 0; i < num_cp; i++) {
+        if (cp[i] >= 0x80) continue;
+        if (out == size - 1) return -1;
+        dest[out++] = cp[i];
+        b++;
+    }
+    if (b) {
+        if (out == size - 1) return -1;
+        dest[out++] = '-';
+    }
+
+    for (h = b; h < num_cp; delta++, n++) {
+        for (i = 0, m = 0x110000; i < num_cp; i++)
+            if (cp[i] >= n && cp[i] < m) m = cp[i];
+        delta += (m - n) * (h + 1);
+        n = m;
+
+        for (i = 0; i < num_cp; i++) {
+            if (cp[i] < n) delta++;
+            if (cp[i] != n) continue;
+
+            /* encode delta as a variable-length integer */
+            for (q = delta, k = PUNY_BASE; ; k += PUNY_BASE) {
+                t = k <= bias ? PUNY_TMIN :
+                    k >= bias + PUNY_TMAX ? PUNY_TMAX : k - bias;
+                if (q < t) break;
+                if (out == size - 1) return -1;
+                m = t + (q - t) % (PUNY_BASE - t);
+                dest[out++] = m < 26 ? 'a' + m : '0' + m - 26;
+                q = (q - t) / (PUNY_BASE - t);
+            }
+            if (out == size - 1) return -1;
+            dest[out++] = q < 26 ? 'a' + q : '0' + q - 26;
+
+            bias = puny_adapt (delta, h + 1, h == b);
+            delta = 0;
+            h++;
+        }
+    }
+
+    if (out > 63) return -1;
+    dest[out] = '\0';
+    return out;
+}
+
+/* idn_to_ascii: copies the BIND-format name src to dest (which holds size
+ * bytes), replacing each label containing UTF-8 characters with its
+ * punycode A-label.  labels with backslash escapes are left alone.
+ * returns 0 on success and 1 otherwise. */
+int idn_to_ascii (char *dest, int size, const char *src)
+{
+    const char *label, *p;
+    int out = 0, ret, ascii, escaped;
+
+    for (label = src; ; label = p + 1) {
+        /* find the end of the label, noting what's in it */
+        for (p = label, ascii = 1, escaped = 0; *p != '\0' && *p != '.';
+             p++) {
+            if (*p == '\\') {
+                escaped = 1;
+                if (*(p+1) != '\0') p++;
+            } else if (*p & 0x80) {
+                ascii = 0;
+            }
+        }
+
+        if (ascii || escaped) {
+            if (out + (p - label) >= size) return 1;
+            memcpy (dest + out, label, p - label);
+            out += p - label;
+        } else {
+            if ((ret = punycode_label (dest + out, size - out, label,
+                           p - label)) < 0) return 1;
+            out += ret;
+        }
+
+        if (*p == '\0') break;
+        if (out + 1 >= size) return 1;
+        dest[out++] = '.';
+    }
+
+    dest[out] = '\0';
+    return 0;
+}
+
+/* fold_case: lowercases the ASCII letters in the first len bytes of
+ * text.  escaped bytes are left alone, since their escapes are digits. */
+void fold_case (char *text, int len)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (text + i));
+        __m128i upper = _mm_and_si128 (
+            _mm_cmpgt_epi8 (v, _mm_set1_epi8 ('A' - 1)),
+            _mm_cmplt_epi8 (v, _mm_set1_epi8 ('Z' + 1)));
+        v = _mm_add_epi8 (v, _mm_and_si128 (upper, _mm_set1_epi8 (0x20)));
+        _mm_storeu_si128 ((__m128i *) (text + i), v);
+    }
+#endif
+    for (; i < len; i++)
+        if (text[i] >= 'A' && text[i] <= 'Z') text[i] += 'a' - 'A';
+}
+
+/* check_labels: checks the labels of the sanitized name text (len bytes
+ * long) in a single pass: none may be empty, apart from the root, or
+ * longer than 63 bytes, counting an escape as one byte.  if ldh is set,
+ * they must also be host names: letters, digits and hyphens, not starting
+ * or ending with a hyphen, except for a leading "*" label.  returns NULL
+ * if the name is fine, and otherwise what's wrong with it. */
+const char *check_labels (const char *text, int len, int ldh)
+{
+    int i = 0, label = 0;
+    char c;
+
+    while (i < len) {
+#ifdef __SSE2__
+        /* skip over blocks of plain label bytes */
+        if (i + 16 <= len) {
+            __m128i v = _mm_loadu_si128 ((const __m128i *) (text + i));
+            __m128i special = _mm_or_si128 (
+                _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('.')),
+                _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\\')));
+            int ok = !_mm_movemask_epi8 (special);
+            if (ok && ldh) {
+                __m128i lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+                __m128i host = _mm_or_si128 (_mm_or_si128 (
+                    _mm_and_si128 (
+                        _mm_cmpgt_epi8 (lower, _mm_set1_epi8 ('a' - 1)),
+                        _mm_cmplt_epi8 (lower, _mm_set1_epi8 ('z' + 1))),
+                    _mm_and_si128 (
+                        _mm_cmpgt_epi8 (v, _mm_set1_epi8 ('0' - 1)),
+                        _mm_cmplt_epi8 (v, _mm_set1_epi8 ('9' + 1)))),
+                    _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('-')));
+                ok = _mm_movemask_epi8 (host) == 0xffff &&
+                     (label || text[i] != '-');
+            }
+            if (ok) {
+                label += 16;
+                i += 16;
+                if (label > 63) return "label longer than 63 bytes";
+                continue;
+            }
+        }
+#endif
+        c = text[i];
+        if (c == '.') {
+            if (!label && len > 1) return "empty label";
+            if (ldh && label && text[i-1] == '-')
+                return "label ends with a hyphen";
+            label = 0;
+            i++;
+            continue;
+        }
+        if (ldh && !isalnum ((unsigned char) c) && c != '-' &&
+            !(c == '*' && i == 0 && (len == 1 || text[1] == '.')))
+            return "not a valid host name";
+        if (ldh && c == '-' && !label)
+            return "label starts with a hyphen";
+        i += c == '\\' ? 4 : 1;
+        if (++label > 63) return "label longer than 63 bytes";
+    }
+    if (ldh && len && text[len-1] == '-') return "label ends with a hyphen";
+    return NULL;
+}
+
+/* check_hostname: with -H, makes sure that name is a valid host name,
+ * which is fatal if it isn't.  what says what the name is for. */
+void check_hostname (const string *name, const char *what)
+{
+    char message[128];
+    const char *err;
+
+    if (!check_hostnames ||
+        !(err = check_labels (name->text, name->real_len, 1)))
+        return;
+    snprintf (message, sizeof (message), "%s: %s", what, err);
+    fatal (message, start_line_num);
+}
+
 /* qualify_domain: given char* name (in BIND format) and string origin
  * (which has already been passed through sanitize_string), constructs a
  * fully-qualified domain name and copies it to dest.  name and origin can
@@ -175,26 +978,41 @@ int sanitize_string (string *dest, const char *src)
 int qualify_domain (string *dest, const char *name, const string *origin)
 {
     string temp, sname;
+    char idn_name[LINE_LEN+1];
+    unsigned char non_ascii = 0;
+    const char *p, *err;
 
     if (!dest || !name) {
         warning ("qualify_domain: missing dest or name", -1);
         return 1;
     }
 
+    /* plain ASCII names (the usual case) don't need IDN conversion */
+    if (idn) {
+        for (p = name; *p != '\0'; p++) non_ascii |= *p;
+        if ((non_ascii & 0x80)) {
+            if (idn_to_ascii (idn_name, sizeof (idn_name), name)) {
+                warning ("qualify_domain: unable to convert "
+                     "internationalized name", -1);
+                return 1;
+            }
+            name = idn_name;
+        }
+    }
+
     if (sanitize_string (&sname, name)) {
         warning ("qualify_domain: unable to sanitize name", -1);
         return 1;
     }
+    /* the origin has already been through here */
+    if (fold_names) fold_case (sname.text, sname.real_len);
 
     /* if sname isn't empty */
     if (sname.len) {
-        if (sname.text[0] == '.' && sname.text[1] != '\0') {
-            warning ("qualify_domain: empty label", -1);
-            return 1;
-        }
-        /* make sure sname doesn't have two dots in a row */
-        if (strstr (sname.text, "..")) {
-            warning ("qualify_domain: empty label", -1);
+        if ((err = check_labels (sname.text, sname.real_len, 0))) {
+            char message[128];
+            snprintf (message, sizeof (message), "qualify_domain: %s", err);
+            warning (message, -1);
             return 1;
         }
         /* if sname is '@' */
@@ -351,101 +1169,451 @@ int sanitize_ip (char *dest, const char *src) {
     return 0;
 }
 
-/* tokenize: tokenizes a line from stdin.  puts the tokens into the token
- * array and returns the number of tokens found, or -1 if the end of the
- * file was reached. */
-int tokenize (char **token)
+/* add_listing: if name (which is within top_origin) is a reversed IPv4
+ * address such as 4.3.2.1.<origin>, records the address as listed with the
+ * return code ip (the dotted-quad rdata of an A record).  other owners are
+ * silently ignored. */
+void add_listing (const string *name, const string *top_origin,
+                  const char *ip)
 {
-    static char line[LINE_LEN+1], *blank_token = " ";
-    int in_doublequote = 0, paren_level = 0;
-    int in_quote = 0, set_in_quote = 0, in_txt = 0, i = 0;
-    int num_tokens = 0, in_token = 0, found_nonblank_token = 0;
+    static int last = -1;
+    unsigned int addr = 0, octet, code;
+    struct in_addr in;
+    int i, len, labels = 0, digits = 0;
+    listing *l;
 
-    start_line_num = line_num;
+    /* find the part of the name in front of the origin */
+    len = name->real_len - 1;
+    if (strcmp (top_origin->text, "."))
+        len -= top_origin->real_len;
+    if (len < 7) return;
 
-    do {
-        if (!fgets (line + i, LINE_LEN + 1 - i, stdin))
-            return -1;
+    for (i = len - 1, octet = 0; i >= -1; i--) {
+        if (i == -1 || name->text[i] == '.') {
+            if (!digits || octet > 255 || labels == 4) return;
+            addr = (addr << 8) | octet;
+            labels++;
+            octet = digits = 0;
+        } else if (isdigit (name->text[i]) && digits < 3) {
+            octet = (name->text[i] - '0') * (digits == 0 ? 1 :
+                    digits == 1 ? 10 : 100) + octet;
+            digits++;
+        } else {
+            return;
+        }
+    }
+    if (labels != 4) return;
 
-        /* tokenize the input and look for obvious syntax
-         * errors */
-        for (; line[i] != '\0' ; i++) {
+    if (!inet_aton (ip, &in)) return;
+    code = ntohl (in.s_addr);
 
-            if (i == LINE_LEN)
-                fatal ("entry too long", start_line_num);
+    /* most zones only use a handful of codes, usually the same one for
+     * long stretches */
+    if (last >= num_listings || last < 0 || listings[last].code != code) {
+        for (last = 0; last < num_listings; last++)
+            if (listings[last].code == code) break;
+        if (last == num_listings) {
+            if (!(listings = realloc (listings,
+                    (num_listings + 1) * sizeof (listing))))
+                fatal ("out of memory collecting listed addresses",
+                       start_line_num);
+            mem_resize (MEM_LISTINGS, 0, sizeof (listing));
+            memset (&listings[num_listings], 0, sizeof (listing));
+            listings[num_listings++].code = code;
+        }
+    }
+    l = &listings[last];
 
-            if (set_in_quote) {
-                in_quote = 1;
-                set_in_quote = 0;
-            }
+    if (l->num_addrs == l->size) {
+        l->size = l->size ? l->size * 2 : 1024;
+        if (!(l->addrs = realloc (l->addrs,
+                    l->size * sizeof (unsigned int))))
+            fatal ("out of memory collecting listed addresses",
+                   start_line_num);
+        mem_resize (MEM_LISTINGS, l->num_addrs * sizeof (unsigned int),
+                l->size * sizeof (unsigned int));
+    }
+    l->addrs[l->num_addrs++] = addr;
+}
 
-            if (line[i] == '\\' && !in_quote) {
-                set_in_quote = 1;
-            } else if (in_quote && line[i] != '\n') {
-                in_quote = 0;
-                continue;
-            }
+/* free_listings: discards all collected listed addresses */
+void free_listings (void)
+{
+    int i;
 
-            if (in_doublequote && line[i] != '"') {
-                continue;
-            }
+    for (i = 0; i < num_listings; i++)
+        free (listings[i].addrs);
+    free (listings);
+    listings = NULL;
+    num_listings = 0;
+    mem_resize (MEM_LISTINGS, mem_reserved[MEM_LISTINGS], 0);
+}
 
-            if (line[i] == ';') {
-                line[i] = '\0';
-                in_token = 0;
-                break;
-            } else if (line[i] == '(') {
-                line[i] = '\0';
-                in_token = 0;
-                if (++paren_level > MAX_PAREN)
-                    fatal ("too many nested parentheses",
-                           start_line_num);
-            } else if (line[i] == ')') {
-                line[i] = '\0';
-                in_token = 0;
-                paren_level--;
-                if (paren_level < 0)
-                    fatal ("missing opening parenthesis",
-                        start_line_num);
-            } else if (line[i] == '"') {
-                line[i] = '\0';
-                if (in_doublequote) {
-                    in_token = 0;
-                } else {
-                    if (!in_txt) {
-                    if (num_tokens == 0 ||
-                        strcasecmp (token[num_tokens-1],
-                                  "txt"))
-                        fatal ("improper use of "
-                        "double-quotes (can only be "
-                        "used for TXT rdata)",
-                        start_line_num);
-                    in_txt = 1;
-                    }
-                    token[num_tokens] =
-                        line + i + 1;
-                    num_tokens++;
-                    in_token = 1;
-                }
-                in_doublequote = !in_doublequote;
-            } else if ((line[i] == ' ' ||
-                    line[i] == '\t')) {
-                if (i == 0) {
-                    token[num_tokens] = blank_token;
-                    num_tokens++;
-                } else {
-                    line[i] = '\0';
-                    in_token = 0;
-                }
-            } else if (line[i] == '\n' || line[i] == '\r') {
-                line[i] = '\0';
-                in_token = 0;
-            } else if (!in_token) {
-                if (num_tokens >= MAX_TOKENS)
-                    fatal ("too many tokens in RR",
-                           start_line_num);
-                token[num_tokens] = line + i;
-                in_token = 1;
+/* compare_uint: qsort comparison function for unsigned ints */
+int compare_uint (const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* put_le: writes the low len bytes of value to f, least significant
+ * byte first */
+void put_le (FILE *f, unsigned long long value, int len)
+{
+    for (; len > 0; len--, value >>= 8)
+        putc (value & 0xff, f);
+}
+
+/* write_roaring: sorts and de-duplicates the addresses in l and writes
+ * them to path as a roaring bitmap in the portable serialization format
+ * shared by the CRoaring, Java and Go implementations (without run
+ * containers).  returns 0 on success and 1 otherwise. */
+int write_roaring (const char *path, listing *l)
+{
+    FILE *f;
+    size_t i, j, n, start, num_containers, offset;
+    unsigned long long bitmap[1024];
+
+    qsort (l->addrs, l->num_addrs, sizeof (unsigned int), compare_uint);
+    for (i = n = 0; i < l->num_addrs; i++)
+        if (!n || l->addrs[i] != l->addrs[n-1])
+            l->addrs[n++] = l->addrs[i];
+    l->num_addrs = n;
+
+    /* one container per distinct value of the upper 16 bits */
+    for (i = 0, num_containers = 0; i < n; i++)
+        if (!i || l->addrs[i] >> 16 != l->addrs[i-1] >> 16)
+            num_containers++;
+
+    if (!(f = fopen (path, "w"))) return 1;
+    put_le (f, ROARING_COOKIE, 4);
+    put_le (f, num_containers, 4);
+
+    /* key and cardinality - 1 of each container */
+    for (start = 0; start < n; start = i) {
+        for (i = start; i < n && l->addrs[i] >> 16 ==
+                 l->addrs[start] >> 16; i++);
+        put_le (f, l->addrs[start] >> 16, 2);
+        put_le (f, i - start - 1, 2);
+    }
+
+    /* offset of each container from the start of the file */
+    offset = 8 + num_containers * 8;
+    for (start = 0; start < n; start = i) {
+        for (i = start; i < n && l->addrs[i] >> 16 ==
+                 l->addrs[start] >> 16; i++);
+        put_le (f, offset, 4);
+        offset += (i - start > ROARING_MAX_ARRAY) ?
+                  sizeof (bitmap) : (i - start) * 2;
+    }
+
+    /* sorted array or 65536-bit bitmap of the low 16 bits */
+    for (start = 0; start < n; start = i) {
+        for (i = start; i < n && l->addrs[i] >> 16 ==
+                 l->addrs[start] >> 16; i++);
+        if (i - start > ROARING_MAX_ARRAY) {
+            memset (bitmap, 0, sizeof (bitmap));
+            for (j = start; j < i; j++)
+                bitmap[(l->addrs[j] & 0xffff) >> 6] |=
+                    1ULL << (l->addrs[j] & 63);
+            for (j = 0; j < 1024; j++)
+                put_le (f, bitmap[j], 8);
+        } else {
+            for (j = start; j < i; j++)
+                put_le (f, l->addrs[j] & 0xffff, 2);
+        }
+    }
+
+    if (ferror (f)) {
+        fclose (f);
+        return 1;
+    }
+    return fclose (f) ? 1 : 0;
+}
+
+/* listing_path: puts the name of the bitmap of the i'th listing into
+ * path, <output>.<code>.roaring, and that of its temp file (the same with
+ * ".tmp" appended) into temp.  returns 0 on success and 1 if either is too
+ * long. */
+int listing_path (char *path, char *temp, const char *output, int i)
+{
+    struct in_addr in;
+
+    in.s_addr = htonl (listings[i].code);
+    if (snprintf (path, PATH_MAX, "%s.%s.roaring", output,
+              inet_ntoa (in)) >= PATH_MAX ||
+        snprintf (temp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return 1;
+    }
+    return 0;
+}
+
+/* finish_listings: renames the bitmaps written by write_listings() into
+ * place if publish is set, and removes them otherwise.  returns 0 on
+ * success and 1 if any couldn't be renamed (with errno set). */
+int finish_listings (const char *output, int publish)
+{
+    char path[PATH_MAX], temp[PATH_MAX];
+    int i, failed = 0;
+
+    for (i = 0; i < num_listings; i++) {
+        if (listing_path (path, temp, output, i)) continue;
+        if (!publish) unlink (temp);
+        else if (rename (temp, path)) {
+            unlink (temp);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+/* write_listings: writes one roaring bitmap per return code to a temp file
+ * next to the output file, to be renamed into place by finish_listings()
+ * once the output is.  returns 0 on success and 1 (with errno set and no
+ * temp files left behind) otherwise. */
+int write_listings (const char *output)
+{
+    char path[PATH_MAX], temp[PATH_MAX];
+    int i, err;
+
+    for (i = 0; i < num_listings; i++) {
+        if (listing_path (path, temp, output, i) ||
+            write_roaring (temp, &listings[i])) {
+            err = errno;
+            finish_listings (output, 0);
+            errno = err;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* hash_name: returns the 64-bit FNV-1a hash of the first len bytes of
+ * name, with ASCII letters lowercased */
+unsigned long long hash_name (const char *name, int len)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    for (; len > 0; len--, name++) {
+        hash ^= (unsigned char) tolower (*name);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* add_owner_hash: records the owner name (without its trailing period)
+ * for the bloom filter */
+void add_owner_hash (const string *name)
+{
+    unsigned long long hash;
+
+    hash = hash_name (name->text, name->real_len > 1 ?
+              name->real_len - 1 : name->real_len);
+    /* records for the same owner usually come together */
+    if (num_owner_hashes && owner_hashes[num_owner_hashes-1] == hash)
+        return;
+
+    if (num_owner_hashes == owner_hashes_size) {
+        owner_hashes_size = owner_hashes_size ?
+                            owner_hashes_size * 2 : 1024;
+        if (!(owner_hashes = realloc (owner_hashes, owner_hashes_size *
+                          sizeof (unsigned long long))))
+            fatal ("out of memory collecting owner names",
+                   start_line_num);
+        mem_resize (MEM_BLOOM, num_owner_hashes *
+                sizeof (unsigned long long), owner_hashes_size *
+                sizeof (unsigned long long));
+    }
+    owner_hashes[num_owner_hashes++] = hash;
+}
+
+/* free_owner_hashes: discards all collected owner hashes */
+void free_owner_hashes (void)
+{
+    free (owner_hashes);
+    owner_hashes = NULL;
+    num_owner_hashes = owner_hashes_size = 0;
+    mem_resize (MEM_BLOOM, mem_reserved[MEM_BLOOM], 0);
+}
+
+/* compare_ull: qsort comparison function for unsigned long longs */
+int compare_ull (const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* write_bloom: writes a blocked bloom filter of the collected owner names
+ * to path.  each name's hash picks one 512-bit block and k bits within it,
+ * with k and the number of blocks chosen for a false-positive rate of
+ * roughly bloom_fp_rate.  the file is a 64-byte header (the 8-byte magic
+ * "B2TBLOOM", then little-endian u32 version, u32 k, u64 number of blocks
+ * and u64 number of names, zero-padded) followed by the blocks.  returns
+ * 0 on success and 1 otherwise. */
+int write_bloom (const char *path)
+{
+    FILE *f;
+    unsigned char *blocks;
+    unsigned long long num_blocks, bits, block;
+    unsigned int a, b, k, bit;
+    size_t i, n;
+    double p;
+
+    qsort (owner_hashes, num_owner_hashes, sizeof (unsigned long long),
+           compare_ull);
+    for (i = n = 0; i < num_owner_hashes; i++)
+        if (!n || owner_hashes[i] != owner_hashes[n-1])
+            owner_hashes[n++] = owner_hashes[i];
+
+    /* an ideal filter needs log2(1/p) hash functions and 1.44 bits per
+     * name for each; blocking costs a little accuracy, so pad by 10% */
+    for (k = 0, p = 1; p > bloom_fp_rate && k < 32; k++) p /= 2;
+    if (!k) k = 1;
+    bits = (unsigned long long) (n * k * 1.4427 * 1.1) + 1;
+    num_blocks = (bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+
+    if (!(blocks = calloc (num_blocks, BLOOM_BLOCK_BITS / 8))) {
+        errno = ENOMEM;
+        return 1;
+    }
+    mem_resize (MEM_BLOOM, 0, num_blocks * (BLOOM_BLOCK_BITS / 8));
+    for (i = 0; i < n; i++) {
+        block = ((owner_hashes[i] >> 32) * num_blocks) >> 32;
+        a = (unsigned int) owner_hashes[i];
+        b = (unsigned int) ((owner_hashes[i] *
+                     0x9e3779b97f4a7c15ULL) >> 32) | 1;
+        for (bit = 0; bit < k; bit++, a += b)
+            blocks[block * (BLOOM_BLOCK_BITS / 8) +
+                   (a % BLOOM_BLOCK_BITS) / 8] |= 1 << (a % 8);
+    }
+
+    if (!(f = fopen (path, "w"))) {
+        free (blocks);
+        mem_resize (MEM_BLOOM, num_blocks * (BLOOM_BLOCK_BITS / 8), 0);
+        return 1;
+    }
+    fwrite (BLOOM_MAGIC, 1, 8, f);
+    put_le (f, 1, 4);
+    put_le (f, k, 4);
+    put_le (f, num_blocks, 8);
+    put_le (f, n, 8);
+    for (i = 32; i < BLOOM_HEADER_LEN; i++)
+        putc (0, f);
+    fwrite (blocks, BLOOM_BLOCK_BITS / 8, num_blocks, f);
+    free (blocks);
+    mem_resize (MEM_BLOOM, num_blocks * (BLOOM_BLOCK_BITS / 8), 0);
+
+    if (ferror (f)) {
+        fclose (f);
+        return 1;
+    }
+    return fclose (f) ? 1 : 0;
+}
+
+/* tokenize: tokenizes a line from the input.  puts the tokens into the token
+ * array and returns the number of tokens found, or -1 if the end of the
+ * file was reached. */
+int tokenize (char **token)
+{
+    static char line[LINE_LEN+1], *blank_token = " ";
+    int in_doublequote = 0, paren_level = 0;
+    int in_quote = 0, set_in_quote = 0, in_txt = 0, i = 0;
+    int num_tokens = 0, in_token = 0, found_nonblank_token = 0;
+    size_t len;
+
+    start_line_num = line_num;
+
+    do {
+        if (!fgets (line + i, LINE_LEN + 1 - i, input))
+            return -1;
+        len = strlen (line + i);
+        bytes_in += len;
+        throttle (&in_bucket, len);
+
+        /* tokenize the input and look for obvious syntax
+         * errors */
+        for (; line[i] != '\0' ; i++) {
+
+            if (i == LINE_LEN)
+                fatal ("entry too long", start_line_num);
+
+            if (set_in_quote) {
+                in_quote = 1;
+                set_in_quote = 0;
+            }
+
+            if (line[i] == '\\' && !in_quote) {
+                set_in_quote = 1;
+            } else if (in_quote && line[i] != '\n') {
+                in_quote = 0;
+                continue;
+            }
+
+            if (in_doublequote && line[i] != '"') {
+                continue;
+            }
+
+            if (line[i] == ';') {
+                line[i] = '\0';
+                in_token = 0;
+                break;
+            } else if (line[i] == '(') {
+                line[i] = '\0';
+                in_token = 0;
+                if (++paren_level > MAX_PAREN)
+                    fatal ("too many nested parentheses",
+                           start_line_num);
+            } else if (line[i] == ')') {
+                line[i] = '\0';
+                in_token = 0;
+                paren_level--;
+                if (paren_level < 0)
+                    fatal ("missing opening parenthesis",
+                        start_line_num);
+            } else if (line[i] == '"') {
+                line[i] = '\0';
+                if (in_doublequote) {
+                    in_token = 0;
+                } else {
+                    if (!in_txt) {
+                    if ((num_tokens == 0 ||
+                         strcasecmp (token[num_tokens-1],
+                                   "txt")) &&
+                        (num_tokens < 4 ||
+                         strcasecmp (token[0], "$GENERATE")))
+                        fatal ("improper use of "
+                        "double-quotes (can only be "
+                        "used for TXT rdata or $GENERATE "
+                        "RHS)", start_line_num);
+                    in_txt = 1;
+                    }
+                    token[num_tokens] =
+                        line + i + 1;
+                    num_tokens++;
+                    in_token = 1;
+                }
+                in_doublequote = !in_doublequote;
+            } else if ((line[i] == ' ' ||
+                    line[i] == '\t')) {
+                if (i == 0) {
+                    token[num_tokens] = blank_token;
+                    num_tokens++;
+                } else {
+                    line[i] = '\0';
+                    in_token = 0;
+                }
+            } else if (line[i] == '\n' || line[i] == '\r') {
+                line[i] = '\0';
+                in_token = 0;
+            } else if (!in_token) {
+                if (num_tokens >= MAX_TOKENS)
+                    fatal ("too many tokens in RR",
+                           start_line_num);
+                token[num_tokens] = line + i;
+                in_token = 1;
                 num_tokens++;
                 found_nonblank_token = 1;
             }
@@ -540,7 +1708,8 @@ void parse_gen_string (char *line, char **parts, int *offsets,
                 if (*ptr == '}') goto PARSE_GEN_STRING_DONE;
                 ptr++;
                 if (*ptr != 'd' && *ptr != 'o' &&
-                    *ptr != 'x' && *ptr != 'X')
+                    *ptr != 'x' && *ptr != 'X' &&
+                    *ptr != 'n' && *ptr != 'N')
                     fatal ("$GENERATE has invalid base",
                            start_line_num);
                 bases[*num_parts-1] = *ptr;
@@ -561,6 +1730,36 @@ PARSE_GEN_STRING_DONE:
     }
 }
 
+/* gen_nibbles: writes value to dest (of length size) as a dot-separated
+ * sequence of hex nibbles, least significant first, as BIND does for the
+ * n and N $GENERATE bases (N gives uppercase digits).  output is padded
+ * with zero nibbles until it is at least width characters long, counting
+ * the dots.  like snprintf, returns the length of the full output, which
+ * is size or more if it didn't fit. */
+int gen_nibbles (char *dest, int size, unsigned int value, int width,
+                 char mode)
+{
+    const char *digits = (mode == 'N') ? "0123456789ABCDEF" :
+                                         "0123456789abcdef";
+    int count = 0;
+
+    do {
+        if (count < size - 1) dest[count] = digits[value & 0x0f];
+        value >>= 4;
+        count++;
+        if (width > 0) width--;
+        /* more nibbles to come need a separator */
+        if (width > 0 || value) {
+            if (count < size - 1) dest[count] = '.';
+            count++;
+            if (width > 0) width--;
+        }
+    } while ((value || width > 0) && count < size);
+
+    dest[count < size ? count : size - 1] = '\0';
+    return count;
+}
+
 /* construct_gen_output: constructs a string for a $generate directive.
  * dest is the destination string of length DOMAIN_STR_LEN, parts is the
  * array of parts, num is the dimension of the array, and iter is the
@@ -575,112 +1774,498 @@ void construct_gen_output (char *dest, char **parts, int *offsets,
         if (parts[i]) {
             ret = snprintf (ptr, DOMAIN_STR_LEN - (ptr - dest),
                     "%s", parts[i]);
+        } else if (bases[i] == 'n' || bases[i] == 'N') {
+            ret = gen_nibbles (ptr, DOMAIN_STR_LEN - (ptr - dest),
+                       iter + offsets[i], widths[i], bases[i]);
         } else {
             snprintf (format, 16, "%%0%d%c", widths[i], bases[i]); 
             ret = snprintf (ptr, DOMAIN_STR_LEN - (ptr - dest),
                     format, iter + offsets[i]);
         }
-        if (ret < 0 || ptr + ret > dest + DOMAIN_STR_LEN)
+        if (ret < 0 || ptr + ret >= dest + DOMAIN_STR_LEN)
             fatal ("$GENERATE directive constructed a token "
                    "that was too long", start_line_num);
         ptr += ret;
     }
 }
 
-/* handle_entry: parses and handles the given entry. */
-int handle_entry (int num_tokens, const char **token, string *cur_origin,
-                  const string *top_origin, unsigned int *ttl) {
+/* in_zone: returns 1 if the fully-qualified name is within top_origin and
+ * 0 otherwise */
+int in_zone (const string *name, const string *top_origin)
+{
+    /* everything is within the root */
+    if (!strcmp (top_origin->text, ".")) return 1;
+
+    /* we know that the data is out-of-zone if:
+     * 1) the origin is longer than the name
+     * 2) the name doesn't end with the origin
+     * 3) the name doesn't equal the origin, and there's no period
+     *    immediately to the left of the origin in the name. */
+    if (top_origin->real_len > name->real_len ||
+        strcasecmp (top_origin->text,
+            name->text + name->real_len - top_origin->real_len) ||
+        (name->real_len > top_origin->real_len &&
+         *(name->text + name->real_len -
+           top_origin->real_len - 1) != '.'))
+        return 0;
+    return 1;
+}
+
+/* rr_type: returns the RR_* index of the named type, or RR_OTHER */
+int rr_type (const char *name)
+{
     int i;
 
-    if (!num_tokens) return 0;
+    for (i = 0; i < RR_OTHER; i++)
+        if (!strcasecmp (name, rr_type_names[i])) return i;
+    return RR_OTHER;
+}
 
-    /* $ORIGIN */
-    if (!strcasecmp (token[0], "$ORIGIN")) {
-        if (num_tokens != 2)
-            fatal ("$ORIGIN directive has wrong number "
-                   "of arguments", start_line_num);
-        if (qualify_domain (cur_origin, token[1], cur_origin))
-            fatal ("choked on domain name in $ORIGIN statement",
-                   start_line_num);
-    /* $TTL */
-    } else if (!strcasecmp (token[0], "$TTL")) {
-        if (num_tokens != 2) {
-            warning ("$TTL directive has wrong number of arguments",
-                     start_line_num);
-            *ttl = DEFAULT_TTL;
-        } else if (str_to_uint (ttl, token[1], 1) ||
-               *ttl > 2147483646) {
-            warning ("invalid $TTL value; using default instead",
-                 start_line_num);
-            *ttl = DEFAULT_TTL;
-        }
-    /* $GENERATE */
-    } else if (!strcasecmp (token[0], "$GENERATE")) {
-        int start, stop, step, found, num_lhs_parts, num_rhs_parts;
-        char *lhs_parts[MAX_GEN_PARTS], *rhs_parts[MAX_GEN_PARTS];
-        int lhs_offsets[MAX_GEN_PARTS], rhs_offsets[MAX_GEN_PARTS];
-        int lhs_widths[MAX_GEN_PARTS], rhs_widths[MAX_GEN_PARTS];
-        char lhs_bases[MAX_GEN_PARTS], rhs_bases[MAX_GEN_PARTS];
-        char lhs_line[LINE_LEN+1], rhs_line[LINE_LEN+1];
-        char lhs_str[DOMAIN_STR_LEN], rhs_str[DOMAIN_STR_LEN];
-        char *gen_token[3];
+/* lint_warning: reports a problem found by the lint pass */
+void lint_warning (const char *message, const char *name, int line_number)
+{
+    char buf[DOMAIN_STR_LEN + 128];
 
-        if (num_tokens != 5)
-            fatal ("$GENERATE directive has wrong number "
-                   "of arguments", start_line_num);
-        if (strcasecmp (token[3], "PTR") &&
-            strcasecmp (token[3], "CNAME") &&
-            strcasecmp (token[3], "A") &&
-            strcasecmp (token[3], "NS"))
-            fatal ("$GENERATE directive has unknown RR type",
-                   start_line_num);
+    snprintf (buf, sizeof (buf), "lint: %s: %s", name, message);
+    warning (buf, line_number);
+    lint_problems++;
+}
 
-        gen_token[1] = (char *) token[3];
+/* rrset_key: returns the lint index key for the given owner hash and
+ * type */
+unsigned long long rrset_key (unsigned long long hash, int type)
+{
+    hash &= ~0xfULL;
+    return (hash ? hash : 0x10) | type;
+}
 
-        /* read range */
-        for (found = 0, start = 0, i = 0;
-             token[1][i] >= '0' && token[1][i] <= '9'; i++) {
-            start *= 10;
-            start += token[1][i] - '0';
-            found = 1;
-        }
-        if (!found || token[1][i] != '-')
-            fatal ("$GENERATE directive has invalid range "
-                   "(unable to parse start)", start_line_num);
-        for (found = 0, stop = 0, i++;
-             token[1][i] >= '0' && token[1][i] <= '9'; i++) {
-            stop *= 10;
-            stop += token[1][i] - '0';
-            found = 1;
-        }
-        if (!found || (token[1][i] != '\0' && token[1][i] != '/'))
-            fatal ("$GENERATE directive has invalid range "
-                   "(unable to parse stop)", start_line_num);
-        if (token[1][i] == '/') {
-            for (found = 0, step = 0, i++;
-                 token[1][i] >= '0' && token[1][i] <= '9'; i++) {
-                step *= 10;
-                step += token[1][i] - '0';
-                found = 1;
-            }
-            if (!found || token[1][i] != '\0' || !step)
-                fatal ("$GENERATE directive has invalid range "
-                       "(unable to parse step)",
-                       start_line_num);
-        } else {
-            step = 1;
+/* find_rrset: looks up key in the lint index.  if it isn't there and
+ * create is set, an empty entry is added for it; otherwise NULL is
+ * returned. */
+rrset_entry *find_rrset (unsigned long long key, int create)
+{
+    rrset_entry *old;
+    size_t i, j, mask, old_size;
+
+    /* keep the table at most 3/4 full */
+    if (create && (num_rrsets + 1) * 4 > rrsets_size * 3) {
+        old = rrsets;
+        old_size = rrsets_size;
+        rrsets_size = rrsets_size ? rrsets_size * 2 : 65536;
+        if (!(rrsets = calloc (rrsets_size, sizeof (rrset_entry))))
+            fatal ("out of memory in lint index", start_line_num);
+        mem_resize (MEM_LINT, 0, rrsets_size * sizeof (rrset_entry));
+        mask = rrsets_size - 1;
+        for (i = 0; i < old_size; i++) {
+            if (!old[i].key) continue;
+            for (j = (old[i].key ^ (old[i].key >> 29)) & mask;
+                 rrsets[j].key; j = (j + 1) & mask);
+            rrsets[j] = old[i];
         }
+        free (old);
+        mem_resize (MEM_LINT, old_size * sizeof (rrset_entry), 0);
+    }
+    if (!rrsets_size) return NULL;
 
-        /* parse lhs and rhs */
-        strcpy (lhs_line, token[2]);
-        strcpy (rhs_line, token[4]);
-        parse_gen_string (lhs_line, lhs_parts, lhs_offsets,
+    mask = rrsets_size - 1;
+    for (i = (key ^ (key >> 29)) & mask; rrsets[i].key;
+         i = (i + 1) & mask)
+        if (rrsets[i].key == key) return &rrsets[i];
+    if (!create) return NULL;
+
+    rrsets[i].key = key;
+    num_rrsets++;
+    return &rrsets[i];
+}
+
+/* lint_record: adds a record to the lint index, reporting mismatched TTLs
+ * within its RRset and CNAMEs that share an owner with other data */
+void lint_record (const string *name, int type, unsigned int ttl)
+{
+    unsigned long long hash;
+    rrset_entry *e;
+    int i;
+
+    if (type == RR_OTHER) return;
+    hash = hash_name (name->text, name->real_len);
+    e = find_rrset (rrset_key (hash, type), 1);
+
+    if (!e->count) e->ttl = ttl;
+    else if (e->ttl != ttl)
+        lint_warning ("TTL differs from the rest of its RRset",
+                  name->text, start_line_num);
+    e->count++;
+
+    if (type == RR_CNAME) {
+        if (e->count > 1)
+            lint_warning ("more than one CNAME record", name->text,
+                      start_line_num);
+        for (i = 0; i < RR_OTHER; i++) {
+            if (i == RR_CNAME ||
+                !find_rrset (rrset_key (hash, i), 0)) continue;
+            lint_warning ("CNAME record alongside other data",
+                      name->text, start_line_num);
+            break;
+        }
+    } else if (find_rrset (rrset_key (hash, RR_CNAME), 0)) {
+        lint_warning ("CNAME record alongside other data", name->text,
+                  start_line_num);
+    }
+}
+
+/* lint_ns_target: remembers an NS record's target if it's within the zone,
+ * so that lint_finish can check that it has addresses */
+void lint_ns_target (const string *target, const string *top_origin)
+{
+    if (!in_zone (target, top_origin)) return;
+
+    if (num_ns_targets == ns_targets_size) {
+        ns_targets_size = ns_targets_size ? ns_targets_size * 2 : 64;
+        if (!(ns_targets = realloc (ns_targets,
+                        ns_targets_size * sizeof (ns_target))))
+            fatal ("out of memory in lint index", start_line_num);
+        mem_resize (MEM_LINT, num_ns_targets * sizeof (ns_target),
+                ns_targets_size * sizeof (ns_target));
+    }
+    ns_targets[num_ns_targets].hash =
+        hash_name (target->text, target->real_len);
+    ns_targets[num_ns_targets].line_number = start_line_num;
+    if (!(ns_targets[num_ns_targets].name = strdup (target->text)))
+        fatal ("out of memory in lint index", start_line_num);
+    mem_resize (MEM_LINT, 0, target->real_len + 1);
+    num_ns_targets++;
+}
+
+/* free_lint: discards the lint index */
+void free_lint (void)
+{
+    size_t i;
+
+    for (i = 0; i < num_ns_targets; i++)
+        free (ns_targets[i].name);
+    free (ns_targets);
+    free (rrsets);
+    ns_targets = NULL;
+    rrsets = NULL;
+    num_ns_targets = ns_targets_size = num_rrsets = rrsets_size = 0;
+    lint_problems = 0;
+    mem_resize (MEM_LINT, mem_reserved[MEM_LINT], 0);
+}
+
+/* lint_finish: once the whole zone has been read, reports a missing SOA or
+ * NS RRset at the apex and in-zone NS targets without addresses */
+void lint_finish (const string *top_origin)
+{
+    unsigned long long hash;
+    size_t i;
+
+    hash = hash_name (top_origin->text, top_origin->real_len);
+    if (!find_rrset (rrset_key (hash, RR_SOA), 0))
+        lint_warning ("no SOA record at zone apex", top_origin->text, -1);
+    if (!find_rrset (rrset_key (hash, RR_NS), 0))
+        lint_warning ("no NS records at zone apex", top_origin->text, -1);
+
+    for (i = 0; i < num_ns_targets; i++) {
+        if (find_rrset (rrset_key (ns_targets[i].hash, RR_A), 0) ||
+            find_rrset (rrset_key (ns_targets[i].hash, RR_AAAA), 0))
+            continue;
+        lint_warning ("in-zone NS target has no A or AAAA records",
+                  ns_targets[i].name, ns_targets[i].line_number);
+    }
+
+    if (lint_problems)
+        fprintf (stderr, "%s%slint: %lu problems found\n",
+             zone_name ? zone_name : "", zone_name ? ": " : "",
+             lint_problems);
+}
+
+/* db_text: copies the sanitized text to out in the zone-file form used in
+ * SQL-backed servers' records tables: decimal rather than octal escapes,
+ * and double quotes escaped.  returns the end of the copy. */
+char *db_text (char *out, const char *text)
+{
+    int c;
+
+    for (; *text != '\0'; text++) {
+        if (*text == '\\') {
+            c = (text[1] - '0') * 64 + (text[2] - '0') * 8 + (text[3] - '0');
+            /* colons only need escaping in tinydns-data */
+            if (c == ':') *out++ = c;
+            else out += sprintf (out, "\\%03d", c);
+            text += 3;
+        } else {
+            if (*text == '"') *out++ = '\\';
+            *out++ = *text;
+        }
+    }
+    *out = '\0';
+    return out;
+}
+
+/* db_grow: makes room for len more bytes after the first used bytes of
+ * db_content, which it returns */
+char *db_grow (size_t used, size_t len)
+{
+    if (used + len > db_content_size) {
+        db_content_size = (used + len) * 2;
+        if (!(db_content = realloc (db_content, db_content_size)))
+            fatal ("out of memory building SQLite record", -1);
+    }
+    return db_content;
+}
+
+/* db_name: copies name to dest (DB_NAME_LEN bytes) as db_text does,
+ * without the trailing period.  returns dest. */
+char *db_name (char *dest, const string *name)
+{
+    char *end = db_text (dest, name->text);
+
+    if (end - dest > 1 && *(end-1) == '.') *(end-1) = '\0';
+    return dest;
+}
+
+#ifdef HAVE_SQLITE
+sqlite3 *db = NULL;
+sqlite3_stmt *db_insert = NULL;
+sqlite3_int64 db_domain_id;
+
+/* db_exec: runs sql on the database, which is fatal if it fails */
+void db_exec (const char *sql)
+{
+    char message[512];
+
+    if (sqlite3_exec (db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+        snprintf (message, sizeof (message), "SQLite: %s",
+              sqlite3_errmsg (db));
+        fatal (message, -1);
+    }
+}
+
+/* db_open: opens (creating if needed) the SQLite database at path and
+ * sets it up for bulk loading: the journal is only kept in memory (enough
+ * to roll back a failed zone), nothing is synced, and there is no index
+ * on record names until db_close.  the tables follow the generic records
+ * schema used by SQL-backed DNS servers such as PowerDNS. */
+void db_open (const char *path)
+{
+    if (sqlite3_open (path, &db) != SQLITE_OK)
+        fatal ("unable to open SQLite database", -1);
+    db_exec ("PRAGMA journal_mode = MEMORY;"
+         "PRAGMA synchronous = OFF;"
+         "PRAGMA locking_mode = EXCLUSIVE;"
+         "PRAGMA cache_size = -65536;"
+         "CREATE TABLE IF NOT EXISTS domains ("
+         "  id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+         "CREATE TABLE IF NOT EXISTS records ("
+         "  id INTEGER PRIMARY KEY, domain_id INTEGER, name TEXT,"
+         "  type TEXT, content TEXT, ttl INTEGER, prio INTEGER);"
+         /* domain ids only grow, so this index is cheap to keep */
+         "CREATE INDEX IF NOT EXISTS records_domain_id"
+         "  ON records (domain_id);"
+         "DROP INDEX IF EXISTS records_name_type;");
+    if (sqlite3_prepare_v2 (db, "INSERT INTO records (domain_id, name, "
+                "type, content, ttl, prio) VALUES (?, ?, ?, ?, ?, ?)",
+                -1, &db_insert, NULL) != SQLITE_OK)
+        fatal ("unable to prepare SQLite insert statement", -1);
+}
+
+/* db_close: builds the deferred index and closes the database.  returns
+ * 0 on success and 1 otherwise. */
+int db_close (void)
+{
+    int failed = 0;
+
+    if (!db) return 0;
+    sqlite3_finalize (db_insert);
+    if (sqlite3_exec (db, "CREATE INDEX IF NOT EXISTS records_name_type "
+              "ON records (name, type)", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf (stderr, "fatal: SQLite: %s\n", sqlite3_errmsg (db));
+        failed = 1;
+    }
+    sqlite3_close (db);
+    db = NULL;
+    return failed;
+}
+
+/* db_begin_zone: starts the transaction that loads the zone for origin,
+ * replacing any records that were loaded for it before.  the old records
+ * are only deleted within the transaction, so they stay if the zone
+ * fails. */
+void db_begin_zone (const string *origin)
+{
+    char name[DB_NAME_LEN], *sql;
+    sqlite3_stmt *stmt;
+
+    db_name (name, origin);
+    db_exec ("BEGIN");
+    if (!(sql = sqlite3_mprintf ("INSERT OR IGNORE INTO domains (name) "
+                     "VALUES (%Q); DELETE FROM records WHERE "
+                     "domain_id = (SELECT id FROM domains WHERE "
+                     "name = %Q)", name, name)))
+        fatal ("out of memory building SQL", -1);
+    db_exec (sql);
+    sqlite3_free (sql);
+
+    db_domain_id = 0;
+    if (sqlite3_prepare_v2 (db, "SELECT id FROM domains WHERE name = ?",
+                -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text (stmt, 1, name, -1, SQLITE_STATIC);
+        if (sqlite3_step (stmt) == SQLITE_ROW)
+            db_domain_id = sqlite3_column_int64 (stmt, 0);
+    }
+    sqlite3_finalize (stmt);
+    if (!db_domain_id) fatal ("unable to find domain in SQLite", -1);
+}
+
+/* db_end_zone: commits the zone, or rolls it back (leaving the records
+ * loaded for it before) if it failed.  returns 0 on success and 1 if the
+ * zone couldn't be committed, in which case it is rolled back. */
+int db_end_zone (int failed)
+{
+    if (!db || sqlite3_get_autocommit (db)) return 0;
+    if (!failed && sqlite3_exec (db, "COMMIT", NULL, NULL, NULL) ==
+            SQLITE_OK)
+        return 0;
+    if (!failed)
+        fprintf (stderr, "%s%sfatal: SQLite: %s\n", zone_name ? zone_name :
+             "", zone_name ? ": " : "", sqlite3_errmsg (db));
+    sqlite3_exec (db, "ROLLBACK", NULL, NULL, NULL);
+    return 1;
+}
+
+/* db_record: adds a record to the current zone */
+void db_record (const string *owner, const char *type, const char *content,
+                unsigned int ttl, int prio)
+{
+    char name[DB_NAME_LEN];
+
+    sqlite3_bind_int64 (db_insert, 1, db_domain_id);
+    sqlite3_bind_text (db_insert, 2, db_name (name, owner), -1,
+               SQLITE_STATIC);
+    sqlite3_bind_text (db_insert, 3, type, -1, SQLITE_STATIC);
+    sqlite3_bind_text (db_insert, 4, content, -1, SQLITE_STATIC);
+    sqlite3_bind_int64 (db_insert, 5, ttl);
+    sqlite3_bind_int (db_insert, 6, prio);
+    if (sqlite3_step (db_insert) != SQLITE_DONE) {
+        char message[512];
+        snprintf (message, sizeof (message), "SQLite: %s",
+              sqlite3_errmsg (db));
+        sqlite3_reset (db_insert);
+        fatal (message, start_line_num);
+    }
+    sqlite3_reset (db_insert);
+}
+#else
+void db_open (const char *path)
+{
+    fatal ("SQLite support not compiled in (rebuild with make SQLITE=1)",
+           -1);
+}
+
+int db_close (void) { return 0; }
+void db_begin_zone (const string *origin) { }
+int db_end_zone (int failed) { return 0; }
+void db_record (const string *owner, const char *type, const char *content,
+                unsigned int ttl, int prio) { }
+#endif
+
+/* handle_entry: parses and handles the given entry. */
+int handle_entry (int num_tokens, const char **token, string *cur_origin,
+                  const string *top_origin, unsigned int *ttl) {
+    int i;
+
+    if (!num_tokens) return 0;
+
+    /* $ORIGIN */
+    if (!strcasecmp (token[0], "$ORIGIN")) {
+        if (num_tokens != 2)
+            fatal ("$ORIGIN directive has wrong number "
+                   "of arguments", start_line_num);
+        if (qualify_domain (cur_origin, token[1], cur_origin))
+            fatal ("choked on domain name in $ORIGIN statement",
+                   start_line_num);
+    /* $TTL */
+    } else if (!strcasecmp (token[0], "$TTL")) {
+        if (num_tokens != 2) {
+            warning ("$TTL directive has wrong number of arguments",
+                     start_line_num);
+            *ttl = DEFAULT_TTL;
+        } else if (str_to_uint (ttl, token[1], 1) ||
+               *ttl > 2147483646) {
+            warning ("invalid $TTL value; using default instead",
+                 start_line_num);
+            *ttl = DEFAULT_TTL;
+        }
+    /* $GENERATE */
+    } else if (!strcasecmp (token[0], "$GENERATE")) {
+        int start, stop, step, found, num_lhs_parts, num_rhs_parts;
+        int num_gen_tokens, num_fixed, is_txt;
+        char *lhs_parts[MAX_GEN_PARTS], *rhs_parts[MAX_GEN_PARTS];
+        int lhs_offsets[MAX_GEN_PARTS], rhs_offsets[MAX_GEN_PARTS];
+        int lhs_widths[MAX_GEN_PARTS], rhs_widths[MAX_GEN_PARTS];
+        char lhs_bases[MAX_GEN_PARTS], rhs_bases[MAX_GEN_PARTS];
+        char lhs_line[LINE_LEN+1], rhs_line[LINE_LEN+1];
+        char lhs_str[DOMAIN_STR_LEN], rhs_str[DOMAIN_STR_LEN];
+        char *gen_token[MAX_TOKENS], *ptr;
+
+        /* $GENERATE range lhs [ttl] [class] type rhs */
+        if (num_tokens < 5 || num_tokens > 7)
+            fatal ("$GENERATE directive has wrong number "
+                   "of arguments", start_line_num);
+
+        /* everything between the lhs and rhs (ttl, class and type) is
+         * passed through to the generated records untouched */
+        for (i = 3; i < num_tokens - 1; i++)
+            gen_token[i-2] = (char *) token[i];
+        num_fixed = num_tokens - 3;
+        is_txt = !strcasecmp (token[num_tokens-2], "TXT");
+
+        /* read range */
+        for (found = 0, start = 0, i = 0;
+             token[1][i] >= '0' && token[1][i] <= '9'; i++) {
+            start *= 10;
+            start += token[1][i] - '0';
+            found = 1;
+        }
+        if (!found || token[1][i] != '-')
+            fatal ("$GENERATE directive has invalid range "
+                   "(unable to parse start)", start_line_num);
+        for (found = 0, stop = 0, i++;
+             token[1][i] >= '0' && token[1][i] <= '9'; i++) {
+            stop *= 10;
+            stop += token[1][i] - '0';
+            found = 1;
+        }
+        if (!found || (token[1][i] != '\0' && token[1][i] != '/'))
+            fatal ("$GENERATE directive has invalid range "
+                   "(unable to parse stop)", start_line_num);
+        if (token[1][i] == '/') {
+            for (found = 0, step = 0, i++;
+                 token[1][i] >= '0' && token[1][i] <= '9'; i++) {
+                step *= 10;
+                step += token[1][i] - '0';
+                found = 1;
+            }
+            if (!found || token[1][i] != '\0' || !step)
+                fatal ("$GENERATE directive has invalid range "
+                       "(unable to parse step)",
+                       start_line_num);
+        } else {
+            step = 1;
+        }
+
+        /* parse lhs and rhs */
+        strcpy (lhs_line, token[2]);
+        strcpy (rhs_line, token[num_tokens-1]);
+        parse_gen_string (lhs_line, lhs_parts, lhs_offsets,
                   lhs_widths, lhs_bases, &num_lhs_parts);
         parse_gen_string (rhs_line, rhs_parts, rhs_offsets,
                   rhs_widths, rhs_bases, &num_rhs_parts);
 
         /* pass generated lines back into this function */
+        phase = "generating";
         for (i = start; i <= stop; i += step) {
+            if (stats_requested) dump_stats (cur_origin);
             construct_gen_output (lhs_str, lhs_parts, lhs_offsets,
                           lhs_widths, lhs_bases,
                           num_lhs_parts, i);
@@ -688,11 +2273,27 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
                           rhs_widths, rhs_bases,
                           num_rhs_parts, i);
             gen_token[0] = lhs_str;
-            gen_token[2] = rhs_str;
+            num_gen_tokens = num_fixed;
+
+            /* the rhs is a single character-string for TXT records,
+             * but may hold several rdata fields for other types */
+            if (is_txt) {
+                gen_token[num_gen_tokens++] = rhs_str;
+            } else {
+                for (ptr = strtok (rhs_str, " \t"); ptr;
+                     ptr = strtok (NULL, " \t")) {
+                    if (num_gen_tokens >= MAX_TOKENS)
+                        fatal ("$GENERATE directive "
+                               "constructed too many "
+                               "tokens", start_line_num);
+                    gen_token[num_gen_tokens++] = ptr;
+                }
+            }
 
-            handle_entry (3, (const char **) gen_token,
+            handle_entry (num_gen_tokens, (const char **) gen_token,
                       cur_origin, top_origin, ttl);
         }
+        phase = "converting";
     /* $INCLUDE */
     } else if (!strcasecmp (token[0], "$INCLUDE")) {
         fatal ("sorry, $INCLUDE directive is not implemented",
@@ -703,9 +2304,10 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
     } else {
         int next;
         unsigned int local_ttl;
-        static string owner;
-        static int prev_owner = 0;
         string rdomain;
+        char rdata[LINE_LEN * 2];         /* record content for -S */
+
+        rdata[0] = '\0';
 
         if (num_tokens < 3) {
             fatal("RR does not have enough tokens", start_line_num);
@@ -715,28 +2317,12 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
             if (qualify_domain(&owner, token[0], cur_origin)) {
                 fatal("choked on owner name in RR", start_line_num);
             }
-            /* we only need to check that this data is within the top-level
-             * origin if the top level origin isn't ".". */
-            if (strcmp(top_origin->text, ".")) {
-                /* we know that the data is out-of-zone if:
-                 * 1) the origin is longer than this record's owner
-                 * 2) the fully-qualified owner doesn't end with the origin
-                 * 3) the owner doesn't equal the origin, and there's no
-                 *    period immediately to the left of the origin in the
-                 *    owner. */
-                if (top_origin->real_len > owner.real_len ||
-                    strcasecmp (top_origin->text,
-                        owner.text + owner.real_len -
-                        top_origin->real_len) ||
-                    (owner.real_len > top_origin->real_len &&
-                     *(owner.text + owner.real_len -
-                       top_origin->real_len - 1) != '.')) {
-                    warning ("ignoring out-of-zone data",
-                         start_line_num);
-                    return 1;
-                }
+            if (!in_zone (&owner, top_origin)) {
+                warning ("ignoring out-of-zone data", start_line_num);
+                return 1;
             }
             prev_owner = 1;
+            if (bloom_fp_rate > 0) add_owner_hash (&owner);
         } else {
             if (!prev_owner) {
                 fatal ("RR tried to inherit owner from "
@@ -774,11 +2360,14 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
             }
         }
 
+        if (lint) lint_record (&owner, rr_type (token[next]), local_ttl);
+
         /* SOA */
         if (!strcasecmp (token[next], "SOA")) {
             string rname;
             unsigned int serial, refresh, retry;
             unsigned int expire, minimum;
+            rr_count[RR_SOA]++;
             if (num_tokens - next - 1 == 2)
                 fatal ("wrong number of tokens in SOA RDATA "
                        "(perhaps an opening parenthesis is on "
@@ -813,11 +2402,21 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
                 minimum > 2147483646)
                 fatal ("invalid MINIMUM in SOA RDATA",
                        start_line_num);
-            fprintf (file, "Z%s:%s:%s:%u:%u:%u:%u:%u\n",
+            emit ("Z%s:%s:%s:%u:%u:%u:%u:%u\n",
                  owner.text, rdomain.text, rname.text,
                  serial, refresh, retry, expire, minimum);
+            if (load_db) {
+                char content[DB_NAME_LEN * 2 + 64], *p;
+                p = db_name (content, &rdomain) + strlen (content);
+                *p++ = ' ';
+                p = db_name (p, &rname) + strlen (p);
+                sprintf (p, " %u %u %u %u %u", serial, refresh, retry,
+                     expire, minimum);
+                db_record (&owner, "SOA", content, local_ttl, 0);
+            }
         /* NS */
         } else if (!strcasecmp (token[next], "NS")) {
+            rr_count[RR_NS]++;
             if (num_tokens - next - 1 != 1)
                 fatal ("wrong number of tokens in NS RDATA",
                        start_line_num);
@@ -825,11 +2424,16 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
                         cur_origin))
                 fatal ("choked on domain name in NS RDATA",
                        start_line_num);
-            fprintf (file, "&%s::%s:%d\n", owner.text,
+            if (lint) lint_ns_target (&rdomain, top_origin);
+            emit ("&%s::%s:%d\n", owner.text,
                  rdomain.text, local_ttl);
+            if (load_db)
+                db_record (&owner, "NS", db_name (rdata, &rdomain),
+                       local_ttl, 0);
         /* MX */
         } else if (!strcasecmp (token[next], "MX")) {
             unsigned int priority;
+            rr_count[RR_MX]++;
             if (num_tokens - next - 1 != 2)
                 fatal ("wrong number of tokens in MX RDATA",
                        start_line_num);
@@ -841,32 +2445,48 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
                         cur_origin))
                 fatal ("choked on domain name in MX RDATA",
                        start_line_num);
-            fprintf (file, "@%s::%s:%d:%d\n", owner.text,
+            check_hostname (&rdomain, "MX target");
+            emit ("@%s::%s:%d:%d\n", owner.text,
                  rdomain.text, priority, local_ttl);
+            if (load_db)
+                db_record (&owner, "MX", db_name (rdata, &rdomain),
+                       local_ttl, priority);
         /* A */
         } else if (!strcasecmp (token[next], "A")) {
             char ip[16];
+            rr_count[RR_A]++;
             if (num_tokens - next - 1 != 1)
                 fatal ("wrong number of tokens in A RDATA",
                        start_line_num);
             if (sanitize_ip (ip, token[next+1]))
                 fatal ("invalid IP address in A RDATA",
                        start_line_num);
-            fprintf (file, "+%s:%s:%d\n", owner.text,
+            check_hostname (&owner, "A record owner");
+            if (export_listings)
+                add_listing (&owner, top_origin, ip);
+            emit ("+%s:%s:%d\n", owner.text,
                  ip, local_ttl);
+            if (load_db) db_record (&owner, "A", ip, local_ttl, 0);
         /* AAAA */
         } else if (!strcasecmp (token[next], "AAAA")) {
             unsigned char ipv6_bytes[16];
+            rr_count[RR_AAAA]++;
             if (num_tokens - next - 1 != 1)
                 fatal ("wrong number of tokens in AAAA RDATA", start_line_num);
             if (!inet_pton(AF_INET6, token[next+1], ipv6_bytes))
                 fatal ("invalid IPv6 address in AAAA RDATA", start_line_num);
-            fprintf (file, ":%s:28:", owner.text);
+            check_hostname (&owner, "AAAA record owner");
+            emit (":%s:28:", owner.text);
             for (i = 0; i < 16; i++)
-                fprintf (file, "\\%03o", ipv6_bytes[i]);
-            fprintf (file, ":%d\n", local_ttl);
+                emit ("\\%03o", ipv6_bytes[i]);
+            emit (":%d\n", local_ttl);
+            if (load_db)
+                db_record (&owner, "AAAA",
+                       inet_ntop (AF_INET6, ipv6_bytes, rdata,
+                              sizeof (rdata)), local_ttl, 0);
         /* CNAME */
         } else if (!strcasecmp (token[next], "CNAME")) {
+            rr_count[RR_CNAME]++;
             if (num_tokens - next - 1 != 1)
                 fatal ("wrong number of tokens in CNAME RDATA",
                        start_line_num);
@@ -874,10 +2494,14 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
                         cur_origin))
                 fatal ("choked on domain name in CNAME RDATA",
                        start_line_num);
-            fprintf (file, "C%s:%s:%d\n", owner.text,
+            emit ("C%s:%s:%d\n", owner.text,
                  rdomain.text, local_ttl);
+            if (load_db)
+                db_record (&owner, "CNAME", db_name (rdata, &rdomain),
+                       local_ttl, 0);
         /* PTR */
         } else if (!strcasecmp (token[next], "PTR")) {
+            rr_count[RR_PTR]++;
             if (num_tokens - next - 1 != 1)
                 fatal ("wrong number of tokens in PTR RDATA",
                        start_line_num);
@@ -885,26 +2509,45 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
                         cur_origin))
                 fatal ("choked on domain name in PTR RDATA",
                        start_line_num);
-            fprintf (file, "^%s:%s:%d\n", owner.text,
+            emit ("^%s:%s:%d\n", owner.text,
                  rdomain.text, local_ttl);
+            if (load_db)
+                db_record (&owner, "PTR", db_name (rdata, &rdomain),
+                       local_ttl, 0);
         /* TXT */
         } else if (!strcasecmp (token[next], "TXT")) {
             string txt_rdata;
+            size_t used = 0;
+            char *p;
+            rr_count[RR_TXT]++;
             if (num_tokens - next - 1 < 1)
                 fatal ("too few tokens in TXT RDATA",
                        start_line_num);
-            fprintf (file, ":%s:16:", owner.text);
+            emit (":%s:16:", owner.text);
             for (i = next + 1; i < num_tokens; i++) {
                 if (sanitize_string (&txt_rdata, token[i]))
                     fatal ("choked while sanitizing TXT "
                            "RDATA", start_line_num);
-                fprintf (file, "\\%03o%s", txt_rdata.len,
+                emit ("\\%03o%s", txt_rdata.len,
                      txt_rdata.text);
+                /* db_text at most doubles the sanitized text */
+                if (load_db) {
+                    p = db_grow (used, txt_rdata.real_len * 2 + 4) + used;
+                    if (used) *p++ = ' ';
+                    *p++ = '"';
+                    p = db_text (p, txt_rdata.text);
+                    *p++ = '"';
+                    *p = '\0';
+                    used = p - db_content;
+                }
             }
-            fprintf (file, ":%d\n", local_ttl);
+            emit (":%d\n", local_ttl);
+            if (load_db)
+                db_record (&owner, "TXT", db_content, local_ttl, 0);
         /* SRV */
         } else if (!strcasecmp (token[next], "SRV")) {
             unsigned int priority, weight, port;
+            rr_count[RR_SRV]++;
             if (num_tokens - next - 1 != 4)
                 fatal ("wrong number of tokens "
                        "in SRV RDATA", start_line_num);
@@ -924,14 +2567,20 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
                         cur_origin))
                 fatal ("choked on domain name in SRV "
                        "RDATA", start_line_num);
-            fprintf (file, ":%s:33:\\%03o\\%03o"
+            emit (":%s:33:\\%03o\\%03o"
                  "\\%03o\\%03o\\%03o\\%03o\\%03o%s"
                  ":%d\n", owner.text, priority / 256,
                  priority % 256, weight / 256, weight % 256,
                  port / 256, port % 256, rdomain.len,
                  rdomain.text, local_ttl);
+            if (load_db) {
+                int n = sprintf (rdata, "%u %u ", weight, port);
+                db_name (rdata + n, &rdomain);
+                db_record (&owner, "SRV", rdata, local_ttl, priority);
+            }
         /* other */
         } else {
+            rr_count[RR_OTHER]++;
             warning ("skipping unknown RR type", start_line_num);
         }
     }
@@ -939,62 +2588,2092 @@ int handle_entry (int num_tokens, const char **token, string *cur_origin,
     return 0;
 }
 
-/* main: */
-int main (int argc, char *argv[])
+/* write_string_field: writes s to f as "<key> <len> <real_len> <text>" */
+void write_string_field (FILE *f, const char *key, const string *s)
 {
-    char *token[MAX_TOKENS];
-    int fd, num_tokens;
-    string origin, cur_origin;
-    unsigned int ttl = DEFAULT_TTL;
+    fprintf (f, "%s %d %d %s\n", key, s->len, s->real_len, s->text);
+}
 
-    if (argc != 4) {
-        fprintf (stderr, "  usage: bind-to-tinydns "
-             "<origin/domain> <output file> <temp file>\n"
-             "    (input is read from stdin)\n");
-        exit (1);
-    }
+/* read_string_field: parses a line written by write_string_field into
+ * dest.  returns 0 on success and 1 otherwise. */
+int read_string_field (string *dest, const char *line, const char *key)
+{
+    int n = 0, text_len;
 
-    /* init origin */
-    origin.text[0] = '.';
-    origin.text[1] = '\0';
-    origin.len = origin.real_len = 1;
-    if (qualify_domain (&origin, argv[1], &origin))
-        fatal ("unable to qualify initial origin", -1);
-    memcpy (&cur_origin, &origin, sizeof (string));
+    /* the text may itself start with a space, so only one is skipped */
+    if (sscanf (line, "%*s %d %d%n", &dest->len, &dest->real_len, &n)
+            != 2 || line[n++] != ' ' || strncmp (line, key, strlen (key)))
+        return 1;
+    text_len = strcspn (line + n, "\n");
+    if (text_len != dest->real_len || text_len >= DOMAIN_STR_LEN ||
+        dest->len > DOMAIN_LEN)
+        return 1;
+    memcpy (dest->text, line + n, text_len);
+    dest->text[text_len] = '\0';
+    return 0;
+}
 
-    /* open temp file */
-    filename = argv[3];
-    if ((fd = open (filename, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
-        fprintf (stderr, "fatal: unable to create temp file: %s\n",
-             strerror (errno));
-        exit (1);
+/* write_context: writes the parser state that conversion can be picked up
+ * from to f: the input and output positions, the line number, $TTL,
+ * $ORIGIN and the owner that a blank owner field would inherit.  the same
+ * lines are used in checkpoints and entry indexes. */
+void write_context (FILE *f, long long in_offset, long long out_len,
+                    const string *cur_origin, unsigned int ttl)
+{
+    fprintf (f, "input %lld\noutput %lld\nline %d\nttl %u\n",
+         in_offset, out_len, line_num, ttl);
+    write_string_field (f, "origin", cur_origin);
+    if (prev_owner) write_string_field (f, "owner", &owner);
+}
+
+/* read_context: reads the lines written by write_context from f into c,
+ * up to the end of the file or a blank line.  returns 0 on success and 1
+ * otherwise. */
+int read_context (FILE *f, checkpoint *c)
+{
+    char line[LINE_LEN+1];
+    int ok;
+
+    memset (c, 0, sizeof (checkpoint));
+    ok = fgets (line, sizeof (line), f) &&
+         sscanf (line, "input %lld", &c->in_offset) == 1 &&
+         fgets (line, sizeof (line), f) &&
+         sscanf (line, "output %lld", &c->out_len) == 1 &&
+         fgets (line, sizeof (line), f) &&
+         sscanf (line, "line %d", &c->line_num) == 1 &&
+         fgets (line, sizeof (line), f) &&
+         sscanf (line, "ttl %u", &c->ttl) == 1 &&
+         fgets (line, sizeof (line), f) &&
+         !read_string_field (&c->origin, line, "origin ");
+    if (ok && fgets (line, sizeof (line), f) && line[0] != '\n') {
+        ok = !read_string_field (&c->owner, line, "owner ");
+        c->prev_owner = 1;
     }
-    if (!(file = fdopen (fd, "w"))) {
-        fprintf (stderr, "fatal: unable to create file stream: %s\n",
-             strerror (errno));
-        exit (1);
+    return !ok;
+}
+
+/* save_checkpoint: makes the temp file durable and records, in
+ * checkpoint_name, how far we've got through the input.  the checkpoint
+ * is written to a temp file and renamed into place, so a crash leaves
+ * either the old or the new one. */
+void save_checkpoint (const string *cur_origin, unsigned int ttl)
+{
+    char temp[PATH_MAX + 4];
+    long long in_offset, out_len;
+    FILE *f;
+    int i, ret;
+
+    if ((in_offset = ftello (input)) == -1)
+        fatal ("unable to get input position for checkpoint", -1);
+    if (fflush (file) || fdatasync (fileno (file)))
+        fatal ("unable to sync temp file for checkpoint", -1);
+    out_len = ftello (file);
+
+    snprintf (temp, sizeof (temp), "%s.tmp", checkpoint_name);
+    if (!(f = fopen (temp, "w")))
+        fatal ("unable to create checkpoint file", -1);
+    fprintf (f, "%s\nrecords", CHECKPOINT_MAGIC);
+    for (i = 0; i < NUM_RR_TYPES; i++) fprintf (f, " %lu", rr_count[i]);
+    fprintf (f, "\n");
+    write_context (f, in_offset, out_len, cur_origin, ttl);
+    ret = ferror (f) | fflush (f) | fsync (fileno (f));
+    if (fclose (f) || ret || rename (temp, checkpoint_name)) {
+        unlink (temp);
+        fatal ("unable to write checkpoint file", -1);
     }
+}
 
-    /* tokenize, parse, and emit each entry */
-    while ((num_tokens = tokenize (token)) != -1)
-        handle_entry (num_tokens, (const char **) token,
-                  &cur_origin, &origin, &ttl);
+/* load_checkpoint: reads checkpoint_name into c.  returns 0 on success and
+ * 1 if there is no checkpoint; a corrupt checkpoint is fatal. */
+int load_checkpoint (checkpoint *c)
+{
+    char line[LINE_LEN+1], *p, *end;
+    unsigned long counts[NUM_RR_TYPES];
+    FILE *f;
+    int i, ok;
 
-    /* close and rename temp file */
-    if (fclose (file)) {
-        fprintf (stderr, "fatal: unable to close temp file: %s\n",
-             strerror (errno));
-        exit (1);
+    if (!(f = fopen (checkpoint_name, "r"))) {
+        if (errno == ENOENT) return 1;
+        fatal ("unable to open checkpoint file", -1);
     }
-    if (rename (filename, argv[2])) {
-        fprintf (stderr, "fatal: unable to rename temp file: %s\n",
-             strerror (errno));
-        if (unlink (filename)) {
-            fprintf (stderr, "unable to unlink temp file: %s\n",
-                 strerror (errno));
+    ok = fgets (line, sizeof (line), f) &&
+         !strncmp (line, CHECKPOINT_MAGIC, strlen (CHECKPOINT_MAGIC)) &&
+         fgets (line, sizeof (line), f) &&
+         !strncmp (line, "records ", 8);
+    for (i = 0, p = line + 7; ok && i < NUM_RR_TYPES; i++, p = end) {
+        counts[i] = strtoul (p, &end, 10);
+        ok = end != p;
+    }
+    ok = ok && *p == '\n' && !read_context (f, c);
+    fclose (f);
+
+    if (!ok) fatal ("corrupt checkpoint file", -1);
+    memcpy (c->rr_count, counts, sizeof (counts));
+    return 0;
+}
+
+/* save_index_entry: appends the context after the num'th entry to the
+ * entry index, so that tools can start reading the zone there */
+void save_index_entry (unsigned long num, const string *cur_origin,
+                       unsigned int ttl)
+{
+    fprintf (index_file, "entry %lu\n", num);
+    write_context (index_file, bytes_in, ftello (file), cur_origin, ttl);
+    fprintf (index_file, "\n");
+}
+
+/* write_full: writes exactly len bytes to fd.  returns 0 on success and 1
+ * otherwise. */
+int write_full (int fd, const void *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        if ((ret = write (fd, buf, len)) == -1) {
+            if (errno == EINTR) continue;
+            return 1;
         }
-        exit (1);
+        buf = (const char *) buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+/* a BGZF block on its way through the decompression pipeline */
+typedef struct gz_slot {
+    unsigned char in[GZ_BLOCK_LEN], out[GZ_BLOCK_LEN];
+    unsigned int in_len, out_len;
+    int state;
+} gz_slot;
+
+/* a slot is filled by the reader, inflated by any worker and then emptied
+ * by the writer, in input order */
+enum { GZ_EMPTY, GZ_FILLED, GZ_WORKING, GZ_DONE };
+
+FILE *gz_in = NULL;                      /* compressed input */
+int gz_out_fd = -1;                      /* pipe to the tokenizer */
+unsigned char gz_prefix[GZ_HEAD_LEN + 65536];   /* bytes read to sniff */
+size_t gz_prefix_len = 0, gz_prefix_pos = 0;
+gz_slot *gz_slots = NULL;
+unsigned long gz_num_slots, gz_next_read, gz_next_write;
+int gz_eof, gz_error, gz_running = 0, gz_num_threads;
+int gz_truncated;                        /* input ended too soon */
+int gz_last_empty;                       /* last block was the EOF marker */
+
+/* the empty block that ends every complete BGZF file */
+const unsigned char gz_eof_block[28] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+    0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+pthread_t gz_threads[GZ_MAX_THREADS + 2];
+pthread_mutex_t gz_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gz_cond = PTHREAD_COND_INITIALIZER;
+
+/* gz_read: reads up to len bytes of compressed input, starting with the
+ * bytes that gunzip_start read to look at the header.  returns the number
+ * of bytes read. */
+size_t gz_read (unsigned char *buf, size_t len)
+{
+    size_t n = 0;
+
+    if (gz_prefix_pos < gz_prefix_len) {
+        n = gz_prefix_len - gz_prefix_pos;
+        if (n > len) n = len;
+        memcpy (buf, gz_prefix + gz_prefix_pos, n);
+        gz_prefix_pos += n;
     }
+    if (n < len) n += fread (buf + n, 1, len - n, gz_in);
+    return n;
+}
+
+/* gz_block_len: returns the total length of the BGZF block whose header
+ * (GZ_HEAD_LEN bytes plus the xlen bytes of extra field) is at head, or 0
+ * if it isn't one */
+unsigned int gz_block_len (const unsigned char *head, unsigned int xlen)
+{
+    const unsigned char *p = head + GZ_HEAD_LEN, *end = p + xlen;
 
+    if (head[0] != 0x1f || head[1] != 0x8b || head[2] != 8 ||
+        !(head[3] & 4))
+        return 0;
+    for (; p + 4 <= end; p += 4 + (p[2] | p[3] << 8))
+        if (p[0] == 'B' && p[1] == 'C' && (p[2] | p[3] << 8) == 2 &&
+            p + 6 <= end)
+            return (p[4] | p[5] << 8) + 1;
     return 0;
 }
+
+/* gz_read_block: reads the next BGZF block into slot.  returns 1 if one
+ * was read, 0 at the end of the input and -1 if the input is bad.  the
+ * input has to end with the EOF marker block; if it ends without it
+ * (perhaps at a block boundary) or partway through a block, the file was
+ * cut short, which sets gz_truncated but still returns 0 so that the
+ * blocks before it are passed on. */
+int gz_read_block (gz_slot *slot)
+{
+    unsigned int xlen, len;
+    size_t n;
+
+    if ((n = gz_read (slot->in, GZ_HEAD_LEN)) == GZ_HEAD_LEN) {
+        xlen = slot->in[10] | slot->in[11] << 8;
+        if (GZ_HEAD_LEN + xlen > GZ_BLOCK_LEN) return -1;
+        if ((n += gz_read (slot->in + n, xlen)) == GZ_HEAD_LEN + xlen) {
+            if (!(len = gz_block_len (slot->in, xlen)) ||
+                len > GZ_BLOCK_LEN || len < n)
+                return -1;
+            if ((n += gz_read (slot->in + n, len - n)) == len) {
+                slot->in_len = len;
+                gz_last_empty = len == sizeof (gz_eof_block) &&
+                                !memcmp (slot->in, gz_eof_block, len);
+                return 1;
+            }
+        }
+    }
+    if (ferror (gz_in)) return -1;
+    gz_truncated = n || !gz_last_empty;
+    return 0;
+}
+
+/* gz_reader: thread that reads BGZF blocks into free slots, in order */
+void *gz_reader (void *arg)
+{
+    gz_slot *slot;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock (&gz_lock);
+        slot = &gz_slots[gz_next_read % gz_num_slots];
+        while (!gz_error && slot->state != GZ_EMPTY)
+            pthread_cond_wait (&gz_cond, &gz_lock);
+        ret = gz_error;
+        pthread_mutex_unlock (&gz_lock);
+        if (ret) break;
+
+        ret = gz_read_block (slot);
+
+        pthread_mutex_lock (&gz_lock);
+        if (ret == 1) {
+            slot->state = GZ_FILLED;
+            gz_next_read++;
+        } else if (ret) gz_error = 1;
+        else gz_eof = 1;
+        pthread_cond_broadcast (&gz_cond);
+        pthread_mutex_unlock (&gz_lock);
+        if (ret != 1) break;
+    }
+    return NULL;
+}
+
+/* gz_worker: thread that inflates filled slots, oldest first */
+void *gz_worker (void *arg)
+{
+    gz_slot *slot;
+    unsigned long seq;
+    z_stream z;
+    int ok;
+
+    pthread_mutex_lock (&gz_lock);
+    for (;;) {
+        for (seq = gz_next_write, slot = NULL; seq < gz_next_read; seq++)
+            if (gz_slots[seq % gz_num_slots].state == GZ_FILLED) {
+                slot = &gz_slots[seq % gz_num_slots];
+                break;
+            }
+        if (!slot) {
+            if (gz_error || gz_eof) break;
+            pthread_cond_wait (&gz_cond, &gz_lock);
+            continue;
+        }
+        slot->state = GZ_WORKING;
+        pthread_mutex_unlock (&gz_lock);
+
+        /* each block is a complete gzip member, trailer and all */
+        memset (&z, 0, sizeof (z));
+        ok = inflateInit2 (&z, 15 + 16) == Z_OK;
+        if (ok) {
+            z.next_in = slot->in;
+            z.avail_in = slot->in_len;
+            z.next_out = slot->out;
+            z.avail_out = GZ_BLOCK_LEN;
+            ok = inflate (&z, Z_FINISH) == Z_STREAM_END && !z.avail_in;
+            slot->out_len = GZ_BLOCK_LEN - z.avail_out;
+            inflateEnd (&z);
+        }
+
+        pthread_mutex_lock (&gz_lock);
+        slot->state = GZ_DONE;
+        if (!ok) gz_error = 1;
+        pthread_cond_broadcast (&gz_cond);
+    }
+    pthread_mutex_unlock (&gz_lock);
+    return NULL;
+}
+
+/* gz_writer: thread that writes inflated slots to the tokenizer's pipe in
+ * input order, and closes it at the end (or on an error) */
+void *gz_writer (void *arg)
+{
+    gz_slot *slot;
+    int ready;
+
+    for (;;) {
+        pthread_mutex_lock (&gz_lock);
+        slot = &gz_slots[gz_next_write % gz_num_slots];
+        while (!gz_error && slot->state != GZ_DONE &&
+               !(gz_eof && gz_next_write == gz_next_read))
+            pthread_cond_wait (&gz_cond, &gz_lock);
+        ready = !gz_error && slot->state == GZ_DONE;
+        pthread_mutex_unlock (&gz_lock);
+        if (!ready) break;
+
+        /* this fails once the tokenizer has given up on the input */
+        if (write_full (gz_out_fd, slot->out, slot->out_len)) {
+            pthread_mutex_lock (&gz_lock);
+            gz_error = 1;
+            pthread_cond_broadcast (&gz_cond);
+            pthread_mutex_unlock (&gz_lock);
+            break;
+        }
+
+        pthread_mutex_lock (&gz_lock);
+        slot->state = GZ_EMPTY;
+        gz_next_write++;
+        pthread_cond_broadcast (&gz_cond);
+        pthread_mutex_unlock (&gz_lock);
+    }
+    close (gz_out_fd);
+    return NULL;
+}
+
+/* gz_stream: thread that inflates input that isn't BGZF (one or more
+ * concatenated gzip members) in a single stream, writing it to the
+ * tokenizer's pipe.  this still overlaps decompression with parsing. */
+void *gz_stream (void *arg)
+{
+    unsigned char *in = gz_slots->in, *out = gz_slots->out;
+    int ret = Z_STREAM_END, full = 0;
+    z_stream z;
+
+    memset (&z, 0, sizeof (z));
+    if (inflateInit2 (&z, 15 + 16) != Z_OK) {
+        gz_error = 1;
+        close (gz_out_fd);
+        return NULL;
+    }
+    for (;;) {
+        /* if the output filled up, there may be more to come without
+         * any more input */
+        if (!z.avail_in && !full) {
+            z.next_in = in;
+            if (!(z.avail_in = gz_read (in, GZ_BLOCK_LEN))) break;
+        }
+        /* another member follows */
+        if (ret == Z_STREAM_END && z.avail_in) inflateReset (&z);
+        z.next_out = out;
+        z.avail_out = GZ_BLOCK_LEN;
+        ret = inflate (&z, Z_NO_FLUSH);
+        full = !z.avail_out;
+        /* no progress, for want of input */
+        if (ret == Z_BUF_ERROR) ret = Z_OK;
+        if ((ret != Z_OK && ret != Z_STREAM_END) ||
+            write_full (gz_out_fd, out, GZ_BLOCK_LEN - z.avail_out)) {
+            gz_error = 1;
+            break;
+        }
+    }
+    if (ferror (gz_in)) gz_error = 1;
+    else if (ret != Z_STREAM_END) gz_truncated = 1;
+    inflateEnd (&z);
+    close (gz_out_fd);
+    return NULL;
+}
+
+/* gunzip_failed: returns nonzero if the decompression threads have given
+ * up on the input, because it's bad or was cut short.  unlike
+ * gunzip_finish, this doesn't wait for them. */
+int gunzip_failed (void)
+{
+    int ret;
+
+    if (!gz_running) return 0;
+    pthread_mutex_lock (&gz_lock);
+    ret = gz_error || gz_truncated;
+    pthread_mutex_unlock (&gz_lock);
+    return ret;
+}
+
+/* gunzip_finish: waits for the decompression threads started by
+ * gunzip_start to exit.  the compressed input is left for the caller to
+ * close.  returns 1 if the input couldn't be decompressed, 2 if it was cut
+ * short and 0 otherwise (or if there's nothing to finish). */
+int gunzip_finish (void)
+{
+    int i;
+
+    if (!gz_running) return 0;
+    pthread_mutex_lock (&gz_lock);
+    pthread_cond_broadcast (&gz_cond);
+    pthread_mutex_unlock (&gz_lock);
+    for (i = 0; i < gz_num_threads; i++)
+        if (gz_threads[i]) pthread_join (gz_threads[i], NULL);
+    free (gz_slots);
+    gz_slots = NULL;
+    gz_running = 0;
+    return gz_error ? 1 : gz_truncated ? 2 : 0;
+}
+
+/* gunzip_start: starts decompressing the gzip input in, and returns a
+ * stream of the decompressed data (or NULL on error).  BGZF input, whose
+ * blocks are independent gzip members that each say how long they are, is
+ * inflated by a thread per CPU (our share of them, and at most -T), a
+ * block at a time; other gzip input is inflated by a single thread.  in stays open either way; once the stream
+ * is closed, gunzip_finish must be called before in is. */
+FILE *gunzip_start (FILE *in)
+{
+    int fds[2], i, bgzf, cpus = 1;
+    cpu_set_t set;
+    FILE *f;
+
+    gz_in = in;
+    gz_eof = gz_error = gz_truncated = gz_last_empty = 0;
+    gz_next_read = gz_next_write = 0;
+    gz_prefix_pos = 0;
+    gz_prefix_len = fread (gz_prefix, 1, GZ_HEAD_LEN, in);
+    bgzf = gz_prefix_len == GZ_HEAD_LEN &&
+           (gz_prefix_len += fread (gz_prefix + GZ_HEAD_LEN, 1,
+                        gz_prefix[10] | gz_prefix[11] << 8, in),
+            gz_block_len (gz_prefix, gz_prefix_len - GZ_HEAD_LEN));
+
+    /* only the CPUs we may run on, which for a pool worker on a NUMA
+     * machine are those of its node, and only our share of them if other
+     * workers run there too */
+    if (!sched_getaffinity (0, sizeof (set), &set))
+        cpus = CPU_COUNT (&set) / cpu_sharers;
+    if (max_gz_threads && cpus > (int) max_gz_threads) cpus = max_gz_threads;
+    gz_num_threads = !bgzf || cpus < 1 ? 1 :
+                     cpus > GZ_MAX_THREADS ? GZ_MAX_THREADS : cpus;
+    gz_num_slots = bgzf ? gz_num_threads * 2 + 2 : 1;
+    if (!(gz_slots = calloc (gz_num_slots, sizeof (gz_slot))))
+        return NULL;
+    if (pipe (fds)) {
+        free (gz_slots);
+        return NULL;
+    }
+    gz_out_fd = fds[1];
+
+    gz_running = 1;
+    if (!bgzf) {
+        if (pthread_create (&gz_threads[0], NULL, gz_stream, NULL))
+            gz_threads[0] = 0, gz_error = 1, close (gz_out_fd);
+    } else {
+        if (pthread_create (&gz_threads[0], NULL, gz_reader, NULL))
+            gz_threads[0] = 0, gz_error = 1;
+        if (pthread_create (&gz_threads[1], NULL, gz_writer, NULL))
+            gz_threads[1] = 0, gz_error = 1, close (gz_out_fd);
+        for (i = 0; i < gz_num_threads; i++)
+            if (pthread_create (&gz_threads[i+2], NULL, gz_worker, NULL))
+                gz_threads[i+2] = 0, gz_error |= !i;
+        gz_num_threads += 2;
+    }
+    if (!(f = fdopen (fds[0], "r"))) {
+        i = errno;
+        close (fds[0]);
+        gunzip_finish ();
+        errno = i;
+    }
+    return f;
+}
+#else
+FILE *gunzip_start (FILE *in)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int gunzip_failed (void)
+{
+    return 0;
+}
+
+int gunzip_finish (void)
+{
+    return 0;
+}
+#endif
+
+/* convert_zone: converts the BIND zone for origin_name read from in into
+ * the tinydns-data file output, by way of the temp file temp.  per-zone
+ * state is reset first, and fatal errors only abort this zone.  with -d,
+ * the temp file is left for publish_jobs to rename.  returns 0 on success
+ * and 1 otherwise. */
+int convert_zone (const char *origin_name, FILE *in, const char *output,
+                  char *temp)
+{
+    char *token[MAX_TOKENS];
+    int fd, num_tokens, ret;
+    unsigned int entries = 0, checkpoint_every = checkpoint_interval;
+    unsigned long num_entries = 0;
+    string origin, cur_origin;
+    unsigned int ttl = DEFAULT_TTL;
+    checkpoint ckpt;
+    jmp_buf env;
+    double mark = 0;
+    char bloom_path[PATH_MAX], bloom_temp[PATH_MAX];
+
+    memset (stage_secs, 0, sizeof (stage_secs));
+    stage_time (STAGE_SETUP, &mark);
+    input = in;
+    line_num = start_line_num = 1;
+    prev_owner = 0;
+    free_listings ();
+    free_owner_hashes ();
+    free_lint ();
+    mem_reserved[MEM_INPUT] = sizeof (input_buf);
+    mem_reserved[MEM_ENTRY] = LINE_LEN + 1;
+    mem_reserved[MEM_OUTPUT] = sizeof (output_buf);
+    memcpy (mem_peak, mem_reserved, sizeof (mem_peak));
+    bytes_in = bytes_out = 0;
+    memset (rr_count, 0, sizeof (rr_count));
+    gettimeofday (&start_time, NULL);
+    last_stats_time = start_time;
+    last_stats_bytes = 0;
+
+    if (setjmp (env)) {
+        fatal_env = NULL;
+        if (load_db) db_end_zone (1);
+        return 1;
+    }
+    fatal_env = &env;
+
+    /* init origin */
+    origin.text[0] = '.';
+    origin.text[1] = '\0';
+    origin.len = origin.real_len = 1;
+    if (qualify_domain (&origin, origin_name, &origin))
+        fatal ("unable to qualify initial origin", -1);
+    memcpy (&cur_origin, &origin, sizeof (string));
+
+    filename = temp;
+    checkpoint_name[0] = '\0';
+    /* resuming would need to seek back to the checkpoint */
+    if (checkpoint_every && lseek (fileno (input), 0, SEEK_CUR) == -1) {
+        warning ("input isn't seekable, so no checkpoints will be saved",
+             -1);
+        checkpoint_every = 0;
+    }
+    if ((checkpoint_every || resume) &&
+        snprintf (checkpoint_name, sizeof (checkpoint_name), "%s.ckpt",
+              temp) >= (int) sizeof (checkpoint_name))
+        fatal ("checkpoint filename too long", -1);
+
+    /* pick up where an earlier run left off, or open a new temp file */
+    if (resume && !load_checkpoint (&ckpt)) {
+        if (fseeko (input, ckpt.in_offset, SEEK_SET))
+            fatal ("unable to seek in input to resume", -1);
+        if ((fd = open (filename, O_WRONLY)) == -1 ||
+            ftruncate (fd, ckpt.out_len) ||
+            lseek (fd, 0, SEEK_END) == -1) {
+            fatal_errno ("unable to reopen temp file");
+            if (fd != -1) close (fd);
+            fatal_env = NULL;
+            return 1;
+        }
+        line_num = ckpt.line_num;
+        ttl = ckpt.ttl;
+        memcpy (&cur_origin, &ckpt.origin, sizeof (string));
+        memcpy (&owner, &ckpt.owner, sizeof (string));
+        prev_owner = ckpt.prev_owner;
+        bytes_in = ckpt.in_offset;
+        bytes_out = ckpt.out_len;
+        memcpy (rr_count, ckpt.rr_count, sizeof (rr_count));
+        warning ("resuming from checkpoint", line_num);
+    } else if ((fd = open (filename, O_WRONLY | O_CREAT | O_EXCL,
+                   0644)) == -1) {
+        fatal_errno ("unable to create temp file");
+        fatal_env = NULL;
+        return 1;
+    }
+    if (!(file = fdopen (fd, "w"))) {
+        fatal_errno ("unable to create file stream");
+        close (fd);
+        unlink (filename);
+        fatal_env = NULL;
+        return 1;
+    }
+    setvbuf (file, output_buf, _IOFBF, sizeof (output_buf));
+
+    if (index_interval) {
+        if (snprintf (index_name, sizeof (index_name), "%s.idx", temp) >=
+                (int) sizeof (index_name))
+            fatal ("index filename too long", -1);
+        if (!(index_file = fopen (index_name, "w")))
+            fatal ("unable to create index file", -1);
+        fprintf (index_file, "%s\n\n", INDEX_MAGIC);
+    }
+
+    if (load_db) db_begin_zone (&origin);
+
+    /* tokenize, parse, and emit each entry */
+    phase = "converting";
+    stage_time (STAGE_SETUP, &mark);
+    for (;;) {
+        num_tokens = tokenize (token);
+        stage_time (STAGE_READ, &mark);
+        if (num_tokens == -1) break;
+        /* if the decompressor gave up, the last entry is likely cut off;
+         * report why rather than what's wrong with it */
+        if (feof (input) && gunzip_failed ()) break;
+        if (stats_requested) dump_stats (&cur_origin);
+        handle_entry (num_tokens, (const char **) token,
+                  &cur_origin, &origin, &ttl);
+        if (checkpoint_every && ++entries == checkpoint_every) {
+            save_checkpoint (&cur_origin, ttl);
+            entries = 0;
+        }
+        if (index_interval && ++num_entries % index_interval == 0)
+            save_index_entry (num_entries, &cur_origin, ttl);
+        stage_time (STAGE_CONVERT, &mark);
+    }
+    if ((ret = gunzip_finish ()))
+        fatal (ret == 2 ? "compressed input is cut short" :
+               "unable to decompress input", -1);
+    phase = "finishing";
+    if (lint) {
+        lint_finish (&origin);
+        free_lint ();
+    }
+    /* the bitmaps are ready before the output is published, so that
+     * failing to write them doesn't fail a zone that's already in place */
+    if (export_listings && write_listings (output)) {
+        char message[256];
+        snprintf (message, sizeof (message), "unable to write bitmap: %s",
+              strerror (errno));
+        fatal (message, -1);
+    }
+    if (bloom_fp_rate > 0) {
+        int err = 0;
+        if (snprintf (bloom_path, sizeof (bloom_path), "%s.bloom",
+                  output) >= (int) sizeof (bloom_path) ||
+            snprintf (bloom_temp, sizeof (bloom_temp), "%s.tmp",
+                  bloom_path) >= (int) sizeof (bloom_temp))
+            err = ENAMETOOLONG;
+        else if (write_bloom (bloom_temp)) {
+            err = errno;
+            unlink (bloom_temp);
+        }
+        if (err) {
+            char message[256];
+            snprintf (message, sizeof (message),
+                  "unable to write bloom filter: %s", strerror (err));
+            if (export_listings) finish_listings (output, 0);
+            fatal (message, -1);
+        }
+    }
+    if (index_file) {
+        FILE *f = index_file;
+        index_file = NULL;
+        if (ferror (f) | fclose (f)) {
+            unlink (index_name);
+            if (export_listings) finish_listings (output, 0);
+            if (bloom_fp_rate > 0) unlink (bloom_temp);
+            fatal ("unable to write index file", -1);
+        }
+    }
+    fatal_env = NULL;
+
+    /* close and rename temp file */
+    if (fclose (file)) {
+        file = NULL;
+        fatal_errno ("unable to close temp file");
+        if (load_db) db_end_zone (1);
+        if (index_interval) unlink (index_name);
+        if (export_listings) finish_listings (output, 0);
+        if (bloom_fp_rate > 0) unlink (bloom_temp);
+        return 1;
+    }
+    file = NULL;
+    /* the database goes first, so that if it can't take the zone, the old
+     * output stays in place as well */
+    if (load_db && db_end_zone (0)) {
+        unlink (filename);
+        if (index_interval) unlink (index_name);
+        if (export_listings) finish_listings (output, 0);
+        if (bloom_fp_rate > 0) unlink (bloom_temp);
+        return 1;
+    }
+    if (!durable && rename (filename, output)) {
+        fatal_errno ("unable to rename temp file");
+        if (unlink (filename)) {
+            fprintf (stderr, "unable to unlink temp file: %s\n",
+                 strerror (errno));
+        }
+        if (index_interval) unlink (index_name);
+        if (export_listings) finish_listings (output, 0);
+        if (bloom_fp_rate > 0) unlink (bloom_temp);
+        return 1;
+    }
+    if (checkpoint_name[0]) unlink (checkpoint_name);
+
+    /* the files describing the output follow it into place.  with -d,
+     * publish_jobs() moves them once it has published the output. */
+    if (index_interval && !durable) {
+        char path[PATH_MAX];
+        if (snprintf (path, sizeof (path), "%s.idx", output) >=
+                (int) sizeof (path) || rename (index_name, path)) {
+            warning ("unable to rename index file into place", -1);
+            unlink (index_name);
+        }
+    }
+    if (export_listings) {
+        if (!durable && finish_listings (output, 1))
+            warning ("unable to rename bitmaps into place", -1);
+        free_listings ();
+    }
+    if (bloom_fp_rate > 0) {
+        if (!durable && rename (bloom_temp, bloom_path))
+            warning ("unable to rename bloom filter into place", -1);
+        free_owner_hashes ();
+    }
+    stage_time (STAGE_FINISH, &mark);
+
+    return 0;
+}
+
+/* run_job: converts the zone described by j, recording the resources that
+ * it used in j->acct.  returns 0 on success and 1 otherwise. */
+int run_job (job *j)
+{
+    FILE *in = stdin, *raw;
+    struct timespec cpu_start, cpu_end;
+    struct timeval wall_end;
+    struct rusage ru;
+    int i, c;
+
+    /* the whole process, so that the decompression threads count too.
+     * nothing else runs in it while a zone is converted. */
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    memset (&j->acct, 0, sizeof (zone_acct));
+
+    if (j->input && !(in = fopen (j->input, "r"))) {
+        fprintf (stderr, "%s: fatal: unable to open %s: %s\n",
+             j->origin, j->input, strerror (errno));
+        j->acct.failed = 1;
+        return 1;
+    }
+    /* the buffer has to be set before the first read */
+    setvbuf (in, input_buf, _IOFBF, sizeof (input_buf));
+    raw = in;
+
+    /* zone files don't start with the first byte of the gzip magic */
+    if ((c = getc (in)) != EOF) ungetc (c, in);
+    if (c == 0x1f && !(in = gunzip_start (raw))) {
+        fprintf (stderr, "%s: fatal: unable to decompress %s: %s\n",
+             j->origin, j->input ? j->input : "input",
+             errno == ENOSYS ? "zlib support not compiled in" :
+             strerror (errno));
+        if (raw != stdin) fclose (raw);
+        j->acct.failed = 1;
+        return 1;
+    }
+    j->acct.failed = convert_zone (j->origin, in, j->output, j->temp);
+    /* closing the pipe first stops a writer thread that's still busy */
+    if (in != raw) fclose (in);
+    gunzip_finish ();
+    if (raw != stdin) fclose (raw);
+
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    gettimeofday (&wall_end, NULL);
+    j->acct.cpu_secs = (cpu_end.tv_sec - cpu_start.tv_sec) +
+                       (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+    j->acct.wall_secs = (wall_end.tv_sec - start_time.tv_sec) +
+                        (wall_end.tv_usec - start_time.tv_usec) / 1e6;
+    j->acct.bytes_in = bytes_in;
+    j->acct.bytes_out = bytes_out;
+    memcpy (j->acct.stage_secs, stage_secs, sizeof (stage_secs));
+    for (i = 0; i < NUM_MEM; i++)
+        j->acct.mem_peak_kb[i] = (mem_peak[i] + 1023) / 1024;
+    for (i = 0; i < NUM_RR_TYPES; i++)
+        j->acct.records += rr_count[i];
+    if (!getrusage (RUSAGE_SELF, &ru))
+        j->acct.max_rss_kb = ru.ru_maxrss;
+
+    return j->acct.failed;
+}
+
+/* batch_error: reports a problem on the given line of the batch file
+ * path, and exits */
+void batch_error (const char *path, int line_number, const char *message)
+{
+    fprintf (stderr, "fatal: %s: line %d: %s\n", path, line_number, message);
+    exit (1);
+}
+
+/* read_jobs: reads a batch file, which has one zone per line in the form
+ * "<origin> <input file> <output file> <temp file>".  blank lines and
+ * lines starting with '#' are skipped.  returns the number of jobs, which
+ * are stored in a malloc'd array in *jobs. */
+int read_jobs (const char *path, job **jobs)
+{
+    FILE *f;
+    char line[LINE_LEN+1], *field[4];
+    int i, n = 0, size = 0, line_number = 0;
+
+    if (!(f = fopen (path, "r"))) {
+        fprintf (stderr, "fatal: unable to open batch file %s: %s\n",
+             path, strerror (errno));
+        exit (1);
+    }
+    *jobs = NULL;
+    while (fgets (line, sizeof (line), f)) {
+        line_number++;
+        if (!(field[0] = strtok (line, " \t\r\n")) || field[0][0] == '#')
+            continue;
+        for (i = 1; i < 4; i++)
+            if (!(field[i] = strtok (NULL, " \t\r\n")))
+                batch_error (path, line_number, "too few fields");
+        if (strtok (NULL, " \t\r\n"))
+            batch_error (path, line_number, "too many fields");
+
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            if (!(*jobs = realloc (*jobs, size * sizeof (job))))
+                fatal ("out of memory reading batch file", -1);
+        }
+        if (!((*jobs)[n].origin = strdup (field[0])) ||
+            !((*jobs)[n].input = strdup (field[1])) ||
+            !((*jobs)[n].output = strdup (field[2])) ||
+            !((*jobs)[n].temp = strdup (field[3])))
+            fatal ("out of memory reading batch file", -1);
+        (*jobs)[n].ahead_len = 0;
+        n++;
+    }
+    fclose (f);
+    return n;
+}
+
+/* read_ahead: called once the first started jobs (in job_order, if it's
+ * set) have been started.
+ * asks the kernel to start reading the input files of the jobs queued
+ * after them, so that converting them doesn't stall on cold reads.  at
+ * most readahead_budget bytes of input that no job has started on yet are
+ * requested, so a long batch doesn't push its own input out of the page
+ * cache before it's used. */
+void read_ahead (job *jobs, int num_jobs, int started)
+{
+    struct stat st;
+    off_t len;
+    int fd;
+
+    /* started jobs don't count against the budget any more */
+    for (; readahead_started < started; readahead_started++)
+        if (readahead_started < readahead_next)
+            readahead_pending -= jobs[job_order ?
+                job_order[readahead_started] : readahead_started].ahead_len;
+    if (readahead_next < started) readahead_next = started;
+
+    while (readahead_next < num_jobs &&
+           readahead_pending < readahead_budget) {
+        job *j = &jobs[job_order ? job_order[readahead_next] :
+                       readahead_next];
+        readahead_next++;
+        if (!j->input || (fd = open (j->input, O_RDONLY)) == -1)
+            continue;
+        if (!fstat (fd, &st) && S_ISREG (st.st_mode)) {
+            len = st.st_size;
+            if (len > readahead_budget - readahead_pending)
+                len = readahead_budget - readahead_pending;
+            if (!posix_fadvise (fd, 0, len, POSIX_FADV_WILLNEED)) {
+                j->ahead_len = len;
+                readahead_pending += len;
+            }
+        }
+        close (fd);
+    }
+}
+
+/* open_dir: opens the directory that path is in, adding it to the dirs
+ * array (of *num_dirs entries) unless it's already there.  returns 0 on
+ * success and 1 otherwise. */
+int open_dir (const char *path, publish_dir **dirs, int *num_dirs)
+{
+    char dir[PATH_MAX], *slash;
+    struct stat st;
+    int i, fd;
+
+    if (snprintf (dir, sizeof (dir), "%s", path) >= (int) sizeof (dir)) {
+        errno = ENAMETOOLONG;
+        return 1;
+    }
+    if (!(slash = strrchr (dir, '/'))) strcpy (dir, ".");
+    else if (slash == dir) dir[1] = '\0';
+    else *slash = '\0';
+
+    if ((fd = open (dir, O_RDONLY | O_DIRECTORY)) == -1) return 1;
+    if (fstat (fd, &st)) {
+        close (fd);
+        return 1;
+    }
+    for (i = 0; i < *num_dirs; i++) {
+        if ((*dirs)[i].dev == st.st_dev && (*dirs)[i].ino == st.st_ino) {
+            close (fd);
+            return 0;
+        }
+    }
+    if (!(*num_dirs & (*num_dirs - 1)) &&
+        !(*dirs = realloc (*dirs, (*num_dirs ? *num_dirs * 2 : 1) *
+                       sizeof (publish_dir))))
+        fatal ("out of memory publishing outputs", -1);
+    (*dirs)[*num_dirs].dev = st.st_dev;
+    (*dirs)[*num_dirs].ino = st.st_ino;
+    (*dirs)[(*num_dirs)++].fd = fd;
+    return 0;
+}
+
+/* publish_file: renames from to to if publish is set, and removes it
+ * otherwise.  returns 0 on success and 1 if it couldn't be renamed. */
+int publish_file (const char *from, const char *to, int publish)
+{
+    if (publish && !rename (from, to)) return 0;
+    unlink (from);
+    return publish;
+}
+
+/* publish_extras: with -d, renames the index, bitmaps and bloom filter
+ * that convert_zone() left for the job into place if publish is set (once
+ * its output has been), and removes them otherwise.  the bitmaps are
+ * found by their names, <output>.<code>.roaring.tmp, since a worker
+ * process doesn't report the codes.  returns 0 on success and 1 if any
+ * couldn't be renamed. */
+int publish_extras (const job *j, int publish)
+{
+    char from[PATH_MAX], to[PATH_MAX], dir[PATH_MAX], **names = NULL;
+    const char *base;
+    struct dirent *e;
+    DIR *d;
+    size_t base_len, dir_len, len;
+    int i, num_names = 0, failed = 0;
+
+    if (index_interval &&
+        snprintf (from, sizeof (from), "%s.idx", j->temp) <
+            (int) sizeof (from) &&
+        snprintf (to, sizeof (to), "%s.idx", j->output) < (int) sizeof (to))
+        failed |= publish_file (from, to, publish);
+    if (bloom_fp_rate > 0 &&
+        snprintf (to, sizeof (to), "%s.bloom", j->output) <
+            (int) sizeof (to) &&
+        snprintf (from, sizeof (from), "%s.tmp", to) < (int) sizeof (from))
+        failed |= publish_file (from, to, publish);
+    if (!export_listings) return failed;
+
+    /* collect the names first, so that renaming them doesn't upset
+     * readdir() */
+    base = (base = strrchr (j->output, '/')) ? base + 1 : j->output;
+    base_len = strlen (base);
+    if ((dir_len = base - j->output) >= sizeof (dir)) return 1;
+    memcpy (dir, j->output, dir_len);
+    dir[dir_len] = '\0';
+    if (!(d = opendir (dir_len ? dir : "."))) return 1;
+    while ((e = readdir (d))) {
+        len = strlen (e->d_name);
+        if (strncmp (e->d_name, base, base_len) ||
+            e->d_name[base_len] != '.' || len < base_len + 13 ||
+            strcmp (e->d_name + len - 12, ".roaring.tmp"))
+            continue;
+        if (!(num_names & (num_names - 1)) &&
+            !(names = realloc (names, (num_names ? num_names * 2 : 1) *
+                         sizeof (char *))))
+            fatal ("out of memory publishing outputs", -1);
+        if (!(names[num_names++] = strdup (e->d_name)))
+            fatal ("out of memory publishing outputs", -1);
+    }
+    closedir (d);
+    for (i = 0; i < num_names; i++) {
+        len = strlen (names[i]);
+        if (snprintf (from, sizeof (from), "%.*s%s", (int) dir_len,
+                  j->output, names[i]) < (int) sizeof (from) &&
+            snprintf (to, sizeof (to), "%.*s%.*s", (int) dir_len, j->output,
+                  (int) len - 4, names[i]) < (int) sizeof (to))
+            failed |= publish_file (from, to, publish);
+        free (names[i]);
+    }
+    free (names);
+    return failed;
+}
+
+/* publish_jobs: with -d, moves the temp files of the jobs that succeeded
+ * into place once every job has run, in a way that survives a crash:
+ * the data of all of them is flushed with one syncfs() per filesystem,
+ * then they are all renamed, and then each directory involved is synced
+ * once, instead of syncing every file and directory in turn.  the index,
+ * bitmaps and bloom filter of each job follow its output.  a job that
+ * can't be published is marked as failed.  returns 0 if every job was
+ * published and 1 otherwise. */
+int publish_jobs (job *jobs, int num_jobs)
+{
+    publish_dir *dirs = NULL;
+    int i, j, num_dirs = 0, failed = 0;
+
+    for (i = 0; i < num_jobs; i++) {
+        if (jobs[i].acct.failed) continue;
+        if (open_dir (jobs[i].temp, &dirs, &num_dirs) ||
+            open_dir (jobs[i].output, &dirs, &num_dirs)) {
+            fprintf (stderr, "%s: fatal: unable to open output "
+                 "directory: %s\n", jobs[i].origin, strerror (errno));
+            jobs[i].acct.failed = failed = 1;
+            unlink (jobs[i].temp);
+            publish_extras (&jobs[i], 0);
+        }
+    }
+
+    /* a filesystem only needs syncing once */
+    for (i = 0; i < num_dirs; i++) {
+        for (j = 0; j < i && dirs[j].dev != dirs[i].dev; j++);
+        if (j == i && syncfs (dirs[i].fd)) {
+            fprintf (stderr, "fatal: unable to sync output files: %s\n",
+                 strerror (errno));
+            for (j = 0; j < num_dirs; j++) close (dirs[j].fd);
+            free (dirs);
+            for (j = 0; j < num_jobs; j++) {
+                if (jobs[j].acct.failed) continue;
+                unlink (jobs[j].temp);
+                publish_extras (&jobs[j], 0);
+                jobs[j].acct.failed = 1;
+            }
+            return 1;
+        }
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+        if (jobs[i].acct.failed) continue;
+        if (rename (jobs[i].temp, jobs[i].output)) {
+            fprintf (stderr, "%s: fatal: unable to rename temp file: "
+                 "%s\n", jobs[i].origin, strerror (errno));
+            unlink (jobs[i].temp);
+            publish_extras (&jobs[i], 0);
+            jobs[i].acct.failed = failed = 1;
+        } else if (publish_extras (&jobs[i], 1)) {
+            fprintf (stderr, "%s: warning: unable to move the files "
+                 "describing the output into place\n", jobs[i].origin);
+        }
+    }
+
+    for (i = 0; i < num_dirs; i++) {
+        if (fsync (dirs[i].fd)) {
+            fprintf (stderr, "fatal: unable to sync output directory: "
+                 "%s\n", strerror (errno));
+            failed = 1;
+        }
+        close (dirs[i].fd);
+    }
+    free (dirs);
+    return failed;
+}
+
+/* print_json_string: prints s to stdout as a JSON string */
+void print_json_string (const char *s)
+{
+    putchar ('"');
+    for (; *s != '\0'; s++) {
+        if ((unsigned char) *s < 0x20) {
+            printf ("\\u%04x", (unsigned char) *s);
+            continue;
+        }
+        if (*s == '"' || *s == '\\') putchar ('\\');
+        putchar (*s);
+    }
+    putchar ('"');
+}
+
+/* print_acct: prints the resources used by each job to stdout, either as
+ * a tab-separated table (easily fed to sort(1)) or as a JSON array. */
+void print_acct (const job *jobs, int num_jobs, int json)
+{
+    const zone_acct *a;
+    int i, s;
+
+    if (json) printf ("[\n");
+    else {
+        printf ("#zone\tstatus\tcpu_s\twall_s\tbytes_in\tbytes_out"
+            "\trecords\tmax_rss_kb");
+        for (s = 0; time_stages && s < NUM_STAGES; s++)
+            printf ("\t%s_s", stage_names[s]);
+        for (s = 0; s < NUM_MEM; s++)
+            printf ("\t%s_kb", mem_names[s]);
+        printf ("\n");
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+        a = &jobs[i].acct;
+        if (json) {
+            printf ("  {\"zone\": ");
+            print_json_string (jobs[i].origin);
+            printf (", \"status\": \"%s\", \"cpu_s\": %.6f, "
+                "\"wall_s\": %.6f, \"bytes_in\": %llu, "
+                "\"bytes_out\": %llu, \"records\": %lu, "
+                "\"max_rss_kb\": %ld",
+                a->failed ? "failed" : "ok", a->cpu_secs,
+                a->wall_secs, a->bytes_in, a->bytes_out,
+                a->records, a->max_rss_kb);
+            for (s = 0; time_stages && s < NUM_STAGES; s++)
+                printf (", \"%s_s\": %.6f", stage_names[s],
+                    a->stage_secs[s]);
+            for (s = 0; s < NUM_MEM; s++)
+                printf (", \"%s_kb\": %lu", mem_names[s],
+                    a->mem_peak_kb[s]);
+            printf ("}%s\n", i < num_jobs - 1 ? "," : "");
+        } else {
+            printf ("%s\t%s\t%.6f\t%.6f\t%llu\t%llu\t%lu\t%ld",
+                jobs[i].origin, a->failed ? "failed" : "ok",
+                a->cpu_secs, a->wall_secs, a->bytes_in,
+                a->bytes_out, a->records, a->max_rss_kb);
+            for (s = 0; time_stages && s < NUM_STAGES; s++)
+                printf ("\t%.6f", a->stage_secs[s]);
+            for (s = 0; s < NUM_MEM; s++)
+                printf ("\t%lu", a->mem_peak_kb[s]);
+            printf ("\n");
+        }
+    }
+
+    if (json) printf ("]\n");
+}
+
+/* read_full: reads exactly len bytes from fd, retrying after interrupts
+ * and short reads.  returns 0 on success and 1 on error or end-of-file. */
+int read_full (int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        if ((ret = read (fd, buf, len)) <= 0) {
+            if (ret == -1 && errno == EINTR) continue;
+            return 1;
+        }
+        buf = (char *) buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* worker_loop: converts the jobs whose indexes arrive on job_fd, reporting
+ * each result on result_fd, until the parent closes job_fd.  the process
+ * (and whatever memory and page cache it has warmed up) is reused for
+ * every zone; convert_zone() resets the per-zone state. */
+void worker_loop (job *jobs, int job_fd, int result_fd)
+{
+    job_result result;
+
+    while (!read_full (job_fd, &result.index, sizeof (result.index))) {
+        zone_name = jobs[result.index].origin;
+        run_job (&jobs[result.index]);
+        zone_name = NULL;
+        result.acct = jobs[result.index].acct;
+        if (write_full (result_fd, &result, sizeof (result)))
+            exit (1);
+    }
+    exit (0);
+}
+
+/* read_numa_nodes: finds the NUMA nodes that have CPUs, and which CPUs
+ * they have, in sysfs.  on a machine with a single node (or without
+ * NUMA), num_nodes ends up at 1 or less and nothing is pinned. */
+void read_numa_nodes (void)
+{
+    char path[64], list[LINE_LEN+1], *range;
+    unsigned int first, last;
+    FILE *f;
+    int n;
+
+    num_nodes = 0;
+    for (n = 0; n < MAX_NODES; n++) {
+        snprintf (path, sizeof (path),
+              "/sys/devices/system/node/node%d/cpulist", n);
+        if (!(f = fopen (path, "r"))) continue;
+        if (!fgets (list, sizeof (list), f)) list[0] = '\0';
+        fclose (f);
+
+        /* the list looks like "0-7,16-23" */
+        CPU_ZERO (&node_cpus[num_nodes]);
+        for (range = strtok (list, ",\n"); range;
+             range = strtok (NULL, ",\n")) {
+            if (sscanf (range, "%u-%u", &first, &last) != 2) last = first;
+            if (sscanf (range, "%u", &first) != 1) continue;
+            for (; first <= last && first < CPU_SETSIZE; first++)
+                CPU_SET (first, &node_cpus[num_nodes]);
+        }
+        if (CPU_COUNT (&node_cpus[num_nodes])) num_nodes++;
+    }
+}
+
+/* bind_to_node: restricts the calling thread to the CPUs of NUMA node
+ * node (modulo the number of nodes).  memory is allocated on the node of
+ * the CPU that first touches it, so buffers used only after this call,
+ * and input pages first read after it, stay local. */
+void bind_to_node (int node)
+{
+    if (num_nodes < 2) return;
+    if (sched_setaffinity (0, sizeof (cpu_set_t),
+                   &node_cpus[node % num_nodes]))
+        warning ("unable to bind to NUMA node", -1);
+}
+
+/* spawn_worker: forks the worker at index w in workers.  the child never
+ * returns.  returns 0 on success and 1 otherwise. */
+int spawn_worker (worker *workers, int num_workers, int w, job *jobs)
+{
+    int job_pipe[2], result_pipe[2], i;
+
+    if (pipe (job_pipe)) return 1;
+    if (pipe (result_pipe)) {
+        close (job_pipe[0]);
+        close (job_pipe[1]);
+        return 1;
+    }
+
+    fflush (stdout);
+    switch (workers[w].pid = fork ()) {
+    case -1:
+        close (job_pipe[0]);
+        close (job_pipe[1]);
+        close (result_pipe[0]);
+        close (result_pipe[1]);
+        return 1;
+    case 0:
+        /* drop our copies of the other workers' pipes, so that they see
+         * end-of-file when the parent closes them */
+        for (i = 0; i < num_workers; i++) {
+            if (i == w || workers[i].pid <= 0) continue;
+            close (workers[i].job_fd);
+            close (workers[i].result_fd);
+        }
+        close (job_pipe[1]);
+        close (result_pipe[0]);
+        /* spread the workers over the nodes, before they touch their
+         * buffers */
+        bind_to_node (w);
+        worker_loop (jobs, job_pipe[0], result_pipe[1]);
+    }
+
+    close (job_pipe[0]);
+    close (result_pipe[1]);
+    workers[w].job_fd = job_pipe[1];
+    workers[w].result_fd = result_pipe[0];
+    workers[w].cur_job = -1;
+    return 0;
+}
+
+/* reap_worker: closes the pipes of worker w and waits for it to exit */
+void reap_worker (worker *w)
+{
+    int status;
+
+    if (w->pid <= 0) return;
+    if (w->job_fd != -1) close (w->job_fd);
+    close (w->result_fd);
+    waitpid (w->pid, &status, 0);
+    w->pid = 0;
+    w->job_fd = w->result_fd = -1;
+    w->cur_job = -1;
+}
+
+/* compare_job_size: qsort comparison function putting job_sizes in
+ * decreasing order of size, and batch order among equals */
+int compare_job_size (const void *a, const void *b)
+{
+    const job_size *x = a, *y = b;
+
+    if (x->len != y->len) return x->len < y->len ? 1 : -1;
+    return x->index - y->index;
+}
+
+/* order_jobs: sets job_order to hand out the jobs with the largest inputs
+ * first.  the pool gives each idle worker the next job, so this keeps a
+ * big zone from starting last and running on alone after the rest of the
+ * batch is done (the longest-processing-time-first rule). */
+void order_jobs (const job *jobs, int num_jobs)
+{
+    job_size *sizes;
+    struct stat st;
+    int i;
+
+    if (!(sizes = malloc (num_jobs * sizeof (job_size))) ||
+        !(job_order = malloc (num_jobs * sizeof (int))))
+        fatal ("out of memory ordering jobs", -1);
+    for (i = 0; i < num_jobs; i++) {
+        sizes[i].len = stat (jobs[i].input, &st) ? 0 : st.st_size;
+        sizes[i].index = i;
+    }
+    qsort (sizes, num_jobs, sizeof (job_size), compare_job_size);
+    for (i = 0; i < num_jobs; i++)
+        job_order[i] = sizes[i].index;
+    free (sizes);
+}
+
+/* give_job: hands the next unassigned job to worker w, or tells it to
+ * exit by closing its job pipe if there are none left.  a worker that has
+ * died in the meantime is replaced.  */
+void give_job (worker *workers, int num_workers, int w, job *jobs,
+               int num_jobs, int *next_job)
+{
+    while (*next_job < num_jobs) {
+        jobs[job_order[*next_job]].temp_existed =
+            !access (jobs[job_order[*next_job]].temp, F_OK);
+        if (!write_full (workers[w].job_fd, &job_order[*next_job],
+                 sizeof (int))) {
+            workers[w].cur_job = job_order[(*next_job)++];
+            if (readahead_budget > 0)
+                read_ahead (jobs, num_jobs, *next_job);
+            return;
+        }
+        reap_worker (&workers[w]);
+        if (spawn_worker (workers, num_workers, w, jobs))
+            fatal ("unable to restart worker process", -1);
+    }
+    close (workers[w].job_fd);
+    workers[w].job_fd = -1;
+    workers[w].cur_job = -1;
+}
+
+/* discard_temp: removes the temp file of a job whose worker died, unless
+ * the worker can't have created it (it was already there, and so belongs
+ * to someone else) or a checkpoint of it was saved, which a later run
+ * with -r can resume from */
+void discard_temp (const job *j)
+{
+    char checkpoint[PATH_MAX];
+
+    if (j->temp_existed) return;
+    if (snprintf (checkpoint, sizeof (checkpoint), "%s.ckpt", j->temp) >=
+            (int) sizeof (checkpoint) || !access (checkpoint, F_OK))
+        return;
+    unlink (j->temp);
+}
+
+/* run_pool: converts jobs using num_workers pre-forked worker processes.
+ * a worker that dies takes only the zone it was converting with it; it is
+ * replaced if there is more work to do.  returns 0 if every job succeeded
+ * and 1 otherwise. */
+int run_pool (job *jobs, int num_jobs, int num_workers)
+{
+    worker workers[MAX_WORKERS];
+    struct pollfd fds[MAX_WORKERS];
+    job_result result;
+    int i, next_job = 0, num_done = 0, failed = 0;
+
+    if (!num_jobs) return 0;
+    order_jobs (jobs, num_jobs);
+    if (num_workers > num_jobs) num_workers = num_jobs;
+    /* the workers pinned to a node (or all of them, without NUMA) split
+     * its CPUs between their decompression threads */
+    cpu_sharers = num_nodes > 1 ?
+                  (num_workers + num_nodes - 1) / num_nodes : num_workers;
+    for (i = 0; i < num_workers; i++)
+        workers[i].pid = 0;
+    for (i = 0; i < num_workers; i++) {
+        if (spawn_worker (workers, num_workers, i, jobs))
+            fatal ("unable to start worker process", -1);
+        give_job (workers, num_workers, i, jobs, num_jobs, &next_job);
+    }
+
+    while (num_done < num_jobs) {
+        for (i = 0; i < num_workers; i++) {
+            fds[i].fd = workers[i].cur_job != -1 ?
+                        workers[i].result_fd : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll (fds, num_workers, -1) == -1) {
+            if (errno == EINTR) continue;
+            fatal ("poll failed while waiting for workers", -1);
+        }
+
+        for (i = 0; i < num_workers; i++) {
+            if (!fds[i].revents) continue;
+
+            if (!read_full (workers[i].result_fd, &result,
+                    sizeof (result)) &&
+                result.index == workers[i].cur_job) {
+                jobs[result.index].acct = result.acct;
+                failed |= result.acct.failed;
+                num_done++;
+                give_job (workers, num_workers, i, jobs, num_jobs,
+                      &next_job);
+                continue;
+            }
+
+            /* the worker died mid-zone */
+            fprintf (stderr, "%s: fatal: worker process died\n",
+                 jobs[workers[i].cur_job].origin);
+            memset (&jobs[workers[i].cur_job].acct, 0,
+                sizeof (zone_acct));
+            jobs[workers[i].cur_job].acct.failed = failed = 1;
+            num_done++;
+            discard_temp (&jobs[workers[i].cur_job]);
+            reap_worker (&workers[i]);
+            if (next_job < num_jobs) {
+                if (spawn_worker (workers, num_workers, i, jobs))
+                    fatal ("unable to restart worker process", -1);
+                give_job (workers, num_workers, i, jobs, num_jobs,
+                      &next_job);
+            }
+        }
+    }
+
+    for (i = 0; i < num_workers; i++)
+        reap_worker (&workers[i]);
+
+    return failed;
+}
+
+/* usage: prints a usage message and exits */
+void usage (void)
+{
+    fprintf (stderr, "  usage: bind-to-tinydns [options] "
+         "<origin/domain> <output file> <temp file>\n"
+         "    (input is read from stdin)\n"
+         "         bind-to-tinydns [options] -b <batch file>\n"
+         "         bind-to-tinydns verify [-t <threads>] <tinydns-data file>\n"
+         "         bind-to-tinydns locations <prefix file>\n"
+         "  options:\n"
+         "    -a <fmt>   report resources used per zone as a table or json\n"
+         "    -j <num>   convert a batch with <num> worker processes\n"
+         "    -d         make the output files durable before finishing\n"
+         "    -R <size>  prefetch up to <size> bytes of queued batch input\n"
+         "    -I         write roaring bitmaps of listed IPv4 addresses\n"
+         "    -C <num>   checkpoint every <num> entries to <temp file>.ckpt\n"
+         "    -r         resume from checkpoints left by an earlier run\n"
+         "    -X <num>   index every <num> entries in <output file>.idx\n"
+         "    -l         report semantic problems in the zone\n"
+         "    -u         convert UTF-8 labels in names to punycode\n"
+         "    -c         lowercase names\n"
+         "    -H         require A/AAAA owners and MX targets to be host names\n"
+         "    -S <db>    also load records into SQLite database <db>\n"
+         "    -F <rate>  write a bloom filter of owner names with false-\n"
+         "               positive rate <rate> (e.g. 0.01)\n"
+         "    -i <rate>  limit input to <rate> bytes/s (k, m, g suffixes)\n"
+         "    -o <rate>  limit output to <rate> bytes/s\n"
+         "    -n <inc>   lower scheduling priority by <inc> (see nice(1))\n"
+         "    -T <num>   inflate bgzip input with at most <num> threads\n");
+    exit (1);
+}
+
+/* check_escapes: makes sure that every backslash in the len bytes at p
+ * is followed by something: either a three-digit octal escape no larger
+ * than \377, or any other character, which tinydns-data takes literally.
+ * returns 0 if so and 1 otherwise. */
+int check_escapes (const char *p, size_t len)
+{
+    const char *end = p + len;
+
+    for (; p < end; p++) {
+        if (*p != '\\') continue;
+        if (end - p < 2) return 1;
+        if (!isdigit ((unsigned char) p[1])) {
+            p++;
+            continue;
+        }
+        if (end - p < 4 || p[1] > '3' ||
+            p[2] < '0' || p[2] > '7' || p[3] < '0' || p[3] > '7')
+            return 1;
+        p += 3;
+    }
+    return 0;
+}
+
+/* check_domain: makes sure that the len bytes at p are a domain name that
+ * tinydns-data will accept: valid escapes, no empty labels, labels of at
+ * most 63 bytes and at most 255 bytes in all.  returns an error message,
+ * or NULL if the name is fine. */
+const char *check_domain (const char *p, size_t len)
+{
+    const char *end = p + len;
+    int label = 0, total = 1;
+
+    /* the root can be written as "" or "." */
+    if (len == 0 || (len == 1 && *p == '.')) return NULL;
+    if (check_escapes (p, len)) return "invalid escape in domain name";
+
+    for (; p < end; p++) {
+        if (*p == '.') {
+            if (!label) return "empty label in domain name";
+            total += label + 1;
+            label = 0;
+            continue;
+        }
+        if (*p == '\\') p += isdigit ((unsigned char) p[1]) ? 3 : 1;
+        if (++label > 63) return "label longer than 63 bytes";
+    }
+    total += label ? label + 1 : 0;
+    return total > 255 ? "domain name longer than 255 bytes" : NULL;
+}
+
+/* check_uint: makes sure that the len bytes at p are empty or a decimal
+ * number no larger than max.  returns 0 if so and 1 otherwise. */
+int check_uint (const char *p, size_t len, unsigned long long max)
+{
+    unsigned long long value = 0;
+
+    if (len > 10) return 1;
+    for (; len > 0; len--, p++) {
+        if (*p < '0' || *p > '9') return 1;
+        value = value * 10 + (*p - '0');
+    }
+    return value > max;
+}
+
+/* check_ip: makes sure that the len bytes at p are empty or a dotted IPv4
+ * address (or, if prefix is set, the first one to four octets of one).
+ * returns 0 if so and 1 otherwise. */
+int check_ip (const char *p, size_t len, int prefix)
+{
+    const char *end = p + len, *dot;
+    int octets = 0;
+
+    if (!len) return 0;
+    for (; p <= end; p = dot + 1) {
+        for (dot = p; dot < end && *dot != '.'; dot++);
+        if (dot == p || ++octets > 4 || check_uint (p, dot - p, 255))
+            return 1;
+    }
+    return !prefix && octets != 4;
+}
+
+/* verify_line: checks one line (without its newline) of tinydns-data
+ * input.  returns an error message, or NULL if the line is fine. */
+const char *verify_line (const char *p, const char *end)
+{
+    const char *f[VERIFY_MAX_FIELDS];
+    size_t len[VERIFY_MAX_FIELDS];
+    const char *err;
+    int i, n, max, ttl_field;
+    char c;
+
+    if (p == end) return NULL;
+    c = *p++;
+    if (c == '#' || c == '-') return NULL;
+
+    /* split into colon-separated fields */
+    for (n = 0; n < VERIFY_MAX_FIELDS; n++) {
+        for (f[n] = p; p < end && *p != ':'; p++);
+        len[n] = p - f[n];
+        if (p++ == end) break;
+    }
+    if (n == VERIFY_MAX_FIELDS) return "too many fields";
+    n++;
+
+    switch (c) {
+    case '%':
+        if (n > 2) return "too many fields";
+        if (len[0] > 2) return "location code longer than 2 bytes";
+        if (n > 1 && check_ip (f[1], len[1], 1))
+            return "invalid IP prefix";
+        return NULL;
+    case '.': case '&':
+        max = 6; ttl_field = 3;
+        if (n > 2 && (err = check_domain (f[2], len[2]))) return err;
+        break;
+    case '=': case '+':
+        max = 5; ttl_field = 2;
+        if (n < 2 || !len[1]) return "missing IP address";
+        break;
+    case '@':
+        max = 7; ttl_field = 4;
+        if (n > 2 && (err = check_domain (f[2], len[2]))) return err;
+        if (n > 3 && check_uint (f[3], len[3], 65535))
+            return "invalid MX distance";
+        break;
+    case '\'':
+        max = 5; ttl_field = 2;
+        if (n > 1 && check_escapes (f[1], len[1]))
+            return "invalid escape in TXT data";
+        break;
+    case '^': case 'C':
+        max = 5; ttl_field = 2;
+        if (n < 2) return "missing target name";
+        if ((err = check_domain (f[1], len[1]))) return err;
+        break;
+    case 'Z':
+        max = 11; ttl_field = 8;
+        if (n > 1 && (err = check_domain (f[1], len[1]))) return err;
+        if (n > 2 && (err = check_domain (f[2], len[2]))) return err;
+        for (i = 3; i < 8 && i < n; i++)
+            if (check_uint (f[i], len[i], 4294967295ULL))
+                return "invalid SOA number";
+        break;
+    case ':':
+        max = 6; ttl_field = 3;
+        if (n < 3) return "missing type or data";
+        if (!len[1] || check_uint (f[1], len[1], 65535))
+            return "invalid record type";
+        switch (atoi (f[1])) {
+        case 0: case 2: case 5: case 6: case 12: case 15: case 252:
+            return "record type not allowed in generic record";
+        }
+        if (check_escapes (f[2], len[2]))
+            return "invalid escape in record data";
+        break;
+    default:
+        return "unrecognized leading character";
+    }
+
+    if (n > max) return "too many fields";
+    if ((err = check_domain (f[0], len[0]))) return err;
+    if ((c == '.' || c == '&' || c == '=' || c == '+' || c == '@') &&
+        n > 1 && check_ip (f[1], len[1], 0))
+        return "invalid IP address";
+    if (n > ttl_field && check_uint (f[ttl_field], len[ttl_field],
+                      4294967295ULL))
+        return "invalid TTL";
+    if (n > ttl_field + 1 && len[ttl_field+1]) {
+        if (len[ttl_field+1] > 16) return "invalid timestamp";
+        for (p = f[ttl_field+1]; p < f[ttl_field+1] + len[ttl_field+1];
+             p++)
+            if (!isxdigit (*p)) return "invalid timestamp";
+    }
+    if (n > ttl_field + 2 && len[ttl_field+2] > 2)
+        return "location code longer than 2 bytes";
+    return NULL;
+}
+
+/* verify_thread: checks every line in a verify_chunk */
+void *verify_thread (void *arg)
+{
+    verify_chunk *c = arg;
+    const char *p, *eol, *err;
+
+    bind_to_node (c->node);
+    for (p = c->start; p < c->end; p = eol + 1) {
+        if (!(eol = memchr (p, '\n', c->end - p))) eol = c->end;
+        if ((err = verify_line (p, eol))) {
+            if (c->num_errors < VERIFY_MAX_ERRORS) {
+                c->error_line[c->num_errors] = c->num_lines;
+                c->error_msg[c->num_errors] = err;
+            }
+            c->num_errors++;
+        }
+        c->num_lines++;
+    }
+    return NULL;
+}
+
+/* verify_main: implements "bind-to-tinydns verify [-t threads] <file>",
+ * which checks that a tinydns-data file will be accepted by tinydns-data
+ * without building a cdb.  the file is mapped into memory and split at
+ * line boundaries between threads.  returns 0 if the file is fine and 1
+ * otherwise. */
+int verify_main (int argc, char *argv[])
+{
+    verify_chunk chunks[VERIFY_MAX_THREADS];
+    pthread_t threads[VERIFY_MAX_THREADS];
+    unsigned int num_threads = 0;
+    unsigned long line = 1, total_errors = 0;
+    const char *data, *p;
+    struct stat st;
+    int i, j, fd, opt;
+    long cpus;
+
+    optind = 1;
+    while ((opt = getopt (argc, argv, "t:")) != -1) {
+        if (opt != 't' || str_to_uint (&num_threads, optarg, 0) ||
+            !num_threads || num_threads > VERIFY_MAX_THREADS)
+            usage ();
+    }
+    if (argc - optind != 1) usage ();
+    if (!num_threads) {
+        cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        num_threads = cpus < 1 ? 1 : cpus > VERIFY_MAX_THREADS ?
+                      VERIFY_MAX_THREADS : cpus;
+    }
+
+    if ((fd = open (argv[optind], O_RDONLY)) == -1 || fstat (fd, &st)) {
+        fprintf (stderr, "fatal: unable to open %s: %s\n", argv[optind],
+             strerror (errno));
+        return 1;
+    }
+    if (!st.st_size) {
+        close (fd);
+        return 0;
+    }
+    if ((data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+            == MAP_FAILED) {
+        fprintf (stderr, "fatal: unable to map %s: %s\n", argv[optind],
+             strerror (errno));
+        return 1;
+    }
+    close (fd);
+
+    /* split at line boundaries.  neighbouring chunks go to the same NUMA
+     * node, so each node's threads fault in one stretch of the file */
+    if ((unsigned long long) st.st_size < num_threads * 65536ULL)
+        num_threads = st.st_size / 65536 + 1;
+    read_numa_nodes ();
+    for (i = 0, p = data; i < (int) num_threads; i++) {
+        memset (&chunks[i], 0, sizeof (verify_chunk));
+        chunks[i].start = p;
+        if (i == (int) num_threads - 1) p = data + st.st_size;
+        else {
+            p = data + st.st_size / num_threads * (i + 1);
+            if (p < chunks[i].start) p = chunks[i].start;
+            while (p < data + st.st_size && *p++ != '\n');
+        }
+        chunks[i].end = p;
+        chunks[i].node = num_nodes > 1 ? i * num_nodes / num_threads : 0;
+    }
+
+    for (i = 0; i < (int) num_threads; i++)
+        if (pthread_create (&threads[i], NULL, verify_thread, &chunks[i]))
+            verify_thread (&chunks[i]), threads[i] = 0;
+    for (i = 0; i < (int) num_threads; i++)
+        if (threads[i]) pthread_join (threads[i], NULL);
+
+    for (i = 0; i < (int) num_threads; i++) {
+        for (j = 0; j < (int) chunks[i].num_errors &&
+             j < VERIFY_MAX_ERRORS; j++)
+            fprintf (stderr, "line %lu: %s\n",
+                 line + chunks[i].error_line[j],
+                 chunks[i].error_msg[j]);
+        if (chunks[i].num_errors > VERIFY_MAX_ERRORS)
+            fprintf (stderr, "(%lu more errors near line %lu)\n",
+                 chunks[i].num_errors - VERIFY_MAX_ERRORS,
+                 line + chunks[i].num_lines - 1);
+        total_errors += chunks[i].num_errors;
+        line += chunks[i].num_lines;
+    }
+
+    /* tinydns-data complains about a final unterminated line, which is
+     * usually a sign of a truncated file */
+    if (data[st.st_size-1] != '\n') {
+        fprintf (stderr, "line %lu: last line is not terminated\n",
+             line - 1);
+        total_errors++;
+    }
+
+    munmap ((void *) data, st.st_size);
+    if (total_errors) {
+        fprintf (stderr, "%lu errors\n", total_errors);
+        return 1;
+    }
+    return 0;
+}
+
+char loc_codes[MAX_LOCATIONS][3];        /* location codes, for loc_node */
+int num_loc_codes = 0;
+unsigned long num_loc_lines = 0;
+
+/* loc_uniform: returns the location that every address under node maps
+ * to, given that inh is the location of the longest prefix above it, or
+ * LOC_MIXED if they don't all map to the same one */
+int loc_uniform (const loc_node *node, int inh)
+{
+    int a, b;
+
+    if (node->loc != LOC_UNSET) inh = node->loc;
+    a = node->child[0] ? loc_uniform (node->child[0], inh) : inh;
+    if (a == LOC_MIXED) return LOC_MIXED;
+    b = node->child[1] ? loc_uniform (node->child[1], inh) : inh;
+    return a == b ? a : LOC_MIXED;
+}
+
+/* loc_emit: prints the "%lo:ipprefix" line mapping the first depth bits
+ * (a multiple of 8) of prefix to location loc */
+void loc_emit (unsigned int prefix, int depth, int loc)
+{
+    int i;
+
+    printf ("%%%s:", loc == LOC_UNSET ? "" : loc_codes[loc]);
+    for (i = 0; i < depth / 8; i++)
+        printf (i ? ".%u" : "%u", (prefix >> (24 - i * 8)) & 255);
+    printf ("\n");
+    num_loc_lines++;
+}
+
+/* loc_compile: prints the location lines for the addresses under node,
+ * which is at an octet boundary depth bits down (node may be NULL if no
+ * prefix was given there).  inh is the location that the input maps the
+ * node's addresses to, ignoring more specific prefixes below it, and
+ * cover is the one that the lines printed so far give them.  tinydns only
+ * knows whole-octet prefixes and uses the longest one that matches, so
+ * when a node's addresses don't all map to the same location, the
+ * location shared by most of its 256 children is given to the node, and
+ * only the children that differ from it get lines of their own. */
+void loc_compile (const loc_node *node, int depth, unsigned int prefix,
+                  int inh, int cover)
+{
+    const loc_node *child[256], *n;
+    int child_inh[256], val[256], count[MAX_LOCATIONS + 1];
+    int c, i, best, best_gain, u;
+
+    u = node ? loc_uniform (node, inh) : inh;
+    if (u != LOC_MIXED) {
+        if (u != cover) loc_emit (prefix, depth, u);
+        return;
+    }
+
+    /* find the 256 children at the next octet boundary */
+    if (node->loc != LOC_UNSET) inh = node->loc;
+    memset (count, 0, sizeof (count));
+    for (c = 0; c < 256; c++) {
+        child_inh[c] = inh;
+        for (n = node, i = 7; n && i >= 0; i--) {
+            n = n->child[(c >> i) & 1];
+            if (n && n->loc != LOC_UNSET) child_inh[c] = n->loc;
+        }
+        child[c] = n;
+        val[c] = n ? loc_uniform (n, child_inh[c]) : child_inh[c];
+        /* unset locations are counted in the last slot */
+        if (val[c] != LOC_MIXED)
+            count[val[c] == LOC_UNSET ? MAX_LOCATIONS : val[c]]++;
+    }
+
+    /* keeping the current cover saves a line here */
+    best = cover;
+    best_gain = count[cover == LOC_UNSET ? MAX_LOCATIONS : cover] + 1;
+    for (i = 0; i <= MAX_LOCATIONS; i++) {
+        if (count[i] > best_gain) {
+            best = i == MAX_LOCATIONS ? LOC_UNSET : i;
+            best_gain = count[i];
+        }
+    }
+    if (best != cover) {
+        loc_emit (prefix, depth, best);
+        cover = best;
+    }
+
+    for (c = 0; c < 256; c++)
+        loc_compile (child[c], depth + 8,
+                 prefix | (unsigned int) c << (24 - depth),
+                 child_inh[c], cover);
+}
+
+/* locations_main: implements "bind-to-tinydns locations <file>", which
+ * reads a file mapping IPv4 prefixes to locations, one "a.b.c.d/len lo"
+ * per line, and prints a compact set of "%lo:ipprefix" lines that give
+ * every address the location of the longest prefix that contains it.
+ * the choice of location for each node is greedy, so the set isn't
+ * always the smallest possible. */
+int locations_main (int argc, char *argv[])
+{
+    FILE *f;
+    char line[LINE_LEN+1], *field[3], *slash;
+    unsigned long num_prefixes = 0;
+    unsigned int len, addr;
+    struct in_addr in;
+    loc_node root, *node;
+    int i, loc;
+
+    if (argc != 2) usage ();
+    if (!(f = fopen (argv[1], "r"))) {
+        fprintf (stderr, "fatal: unable to open %s: %s\n", argv[1],
+             strerror (errno));
+        return 1;
+    }
+
+    memset (&root, 0, sizeof (root));
+    root.loc = LOC_UNSET;
+    line_num = 0;
+    while (fgets (line, sizeof (line), f)) {
+        line_num++;
+        if (!(field[0] = strtok (line, " \t\r\n")) || field[0][0] == '#')
+            continue;
+        if (!(field[1] = strtok (NULL, " \t\r\n")) ||
+            (field[2] = strtok (NULL, " \t\r\n")))
+            fatal ("expected a prefix and a location", line_num);
+
+        len = 32;
+        if ((slash = strchr (field[0], '/'))) {
+            *slash = '\0';
+            if (str_to_uint (&len, slash + 1, 0) || len > 32)
+                fatal ("invalid prefix length", line_num);
+        }
+        if (!inet_aton (field[0], &in))
+            fatal ("invalid IPv4 address", line_num);
+        addr = ntohl (in.s_addr);
+        if (len < 32) addr &= ~(0xffffffffU >> len);
+
+        if (strlen (field[1]) > 2 || strchr (field[1], ':'))
+            fatal ("locations must be one or two characters", line_num);
+        for (loc = 0; loc < num_loc_codes; loc++)
+            if (!strcmp (loc_codes[loc], field[1])) break;
+        if (loc == num_loc_codes) {
+            if (num_loc_codes == MAX_LOCATIONS)
+                fatal ("too many locations", line_num);
+            strcpy (loc_codes[num_loc_codes++], field[1]);
+        }
+
+        for (node = &root, i = 0; i < (int) len; i++) {
+            loc_node **next = &node->child[(addr >> (31 - i)) & 1];
+            if (!*next) {
+                if (!(*next = calloc (1, sizeof (loc_node))))
+                    fatal ("out of memory building prefix trie", -1);
+                (*next)->loc = LOC_UNSET;
+            }
+            node = *next;
+        }
+        if (node->loc != LOC_UNSET && node->loc != loc)
+            warning ("prefix given twice; using the later location",
+                 line_num);
+        node->loc = loc;
+        num_prefixes++;
+    }
+    fclose (f);
+
+    loc_compile (&root, 0, 0, LOC_UNSET, LOC_UNSET);
+    fprintf (stderr, "locations: %lu prefixes compiled into %lu lines\n",
+         num_prefixes, num_loc_lines);
+    return 0;
+}
+
+/* main: */
+int main (int argc, char *argv[])
+{
+    int i, opt, num_jobs, failed = 0, acct_json = -1;
+    unsigned int nice_inc = 0, num_workers = 0;
+    char *batch_file = NULL, *db_path = NULL, *end;
+    job single, *jobs;
+    struct sigaction sa;
+
+    if (argc > 1 && !strcmp (argv[1], "verify"))
+        return verify_main (argc - 1, argv + 1);
+    if (argc > 1 && !strcmp (argv[1], "locations"))
+        return locations_main (argc - 1, argv + 1);
+
+    while ((opt = getopt (argc, argv, "a:b:i:j:o:n:dlrucC:F:HIR:S:T:X:"))
+           != -1) {
+        switch (opt) {
+        case 'a':
+            if (!strcmp (optarg, "table")) acct_json = 0;
+            else if (!strcmp (optarg, "json")) acct_json = 1;
+            else usage ();
+            time_stages = 1;
+            break;
+        case 'b':
+            batch_file = optarg;
+            break;
+        case 'i':
+            if (parse_rate (&in_bucket.rate, optarg)) usage ();
+            break;
+        case 'j':
+            if (str_to_uint (&num_workers, optarg, 0) ||
+                !num_workers || num_workers > MAX_WORKERS)
+                usage ();
+            break;
+        case 'o':
+            if (parse_rate (&out_bucket.rate, optarg)) usage ();
+            break;
+        case 'n':
+            if (str_to_uint (&nice_inc, optarg, 0) || nice_inc > 40)
+                usage ();
+            break;
+        case 'd':
+            durable = 1;
+            break;
+        case 'l':
+            lint = 1;
+            break;
+        case 'r':
+            resume = 1;
+            break;
+        case 'u':
+            idn = 1;
+            break;
+        case 'c':
+            fold_names = 1;
+            break;
+        case 'H':
+            check_hostnames = 1;
+            break;
+        case 'C':
+            if (str_to_uint (&checkpoint_interval, optarg, 0) ||
+                !checkpoint_interval)
+                usage ();
+            break;
+        case 'F':
+            bloom_fp_rate = strtod (optarg, &end);
+            if (*end != '\0' || bloom_fp_rate <= 0 || bloom_fp_rate >= 1)
+                usage ();
+            break;
+        case 'I':
+            export_listings = 1;
+            break;
+        case 'R':
+            if (parse_rate (&readahead_budget, optarg)) usage ();
+            break;
+        case 'S':
+            db_path = optarg;
+            break;
+        case 'T':
+            if (str_to_uint (&max_gz_threads, optarg, 0) || !max_gz_threads)
+                usage ();
+            break;
+        case 'X':
+            if (str_to_uint (&index_interval, optarg, 0) ||
+                !index_interval)
+                usage ();
+            break;
+        default:
+            usage ();
+        }
+    }
+    if (argc - optind != (batch_file ? 0 : 3)) usage ();
+    if (num_workers && !batch_file) usage ();
+    /* the exports, lint index and entry index cover the whole zone and
+     * can't be resumed */
+    if (resume && (export_listings || bloom_fp_rate > 0 || lint ||
+               index_interval))
+        usage ();
+    /* a zone's records are replaced in a single transaction, which
+     * neither a resumed zone nor several worker processes can share */
+    if (db_path && (resume || num_workers)) usage ();
+
+    if (batch_file) {
+        num_jobs = read_jobs (batch_file, &jobs);
+    } else {
+        single.origin = argv[optind];
+        single.input = NULL;
+        single.output = argv[optind+1];
+        single.temp = argv[optind+2];
+        jobs = &single;
+        num_jobs = 1;
+    }
+
+    if (nice_inc) {
+        errno = 0;
+        if (nice (nice_inc) == -1 && errno)
+            warning ("unable to lower scheduling priority", -1);
+    }
+
+    /* dump progress counters on SIGUSR1 */
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = handle_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGUSR1, &sa, NULL);
+
+    /* a dead worker, or a tokenizer that has given up on decompressed
+     * input, shows up as a failed write rather than a signal */
+    signal (SIGPIPE, SIG_IGN);
+
+    if (db_path) {
+        db_open (db_path);
+        load_db = 1;
+    }
+
+    if (num_workers) {
+        read_numa_nodes ();
+        failed = run_pool (jobs, num_jobs, num_workers);
+    } else {
+        for (i = 0; i < num_jobs; i++) {
+            if (batch_file) zone_name = jobs[i].origin;
+            if (batch_file && readahead_budget > 0)
+                read_ahead (jobs, num_jobs, i + 1);
+            failed |= run_job (&jobs[i]);
+        }
+        zone_name = NULL;
+    }
+    if (durable) failed |= publish_jobs (jobs, num_jobs);
+
+    if (load_db) failed |= db_close ();
+    if (acct_json != -1) print_acct (jobs, num_jobs, acct_json);
+
+    return failed;
+}